@@ -5,6 +5,8 @@
 #include "bench.h"
 #include "uci.h"
 #include "utils.h"
+#include "movegen.h"
+#include "evaluate.h"
 
 namespace Belette {
 
@@ -62,6 +64,16 @@ std::vector<std::string> BENCH_POSITIONS = {
     "2r2b2/5p2/5k2/p1r1pP2/P2pB3/1P3P2/K1P3R1/7R w - - 23 93"
 };
 
+// Every position of a game, searched in order without clearing the engine between moves. Measures what is kept from one
+// search to the next of a game (hash, move ordering history). Moves of a Belette self-play game
+std::vector<std::string> BENCH_GAME = {
+    "e2e4", "e7e5", "g1f3", "b8c6", "b1c3", "g8f6", "f1c4", "f8c5", "d2d3", "h7h6", "e1g1", "e8g8", "c3d5", "d7d6", "c2c3", "c5b6",
+    "a2a4", "c8e6", "d5b6", "c7b6", "c4e6", "f7e6", "b2b4", "d8c7", "c1b2", "d6d5", "d1e2", "d5e4", "d3e4", "c6e7", "g2g3", "a8d8",
+    "b4b5", "f6d7", "c3c4", "e7g6", "h2h4", "d7f6", "a1d1", "d8d1", "f1d1", "c7c5", "f3d2", "h6h5", "d2f3", "f6g4", "g1g2", "c5e7",
+    "d1f1", "e7d6", "f3g5", "d6e7", "b2c3", "f8e8", "a4a5", "b6a5", "c3a5", "g4f6", "f1b1", "e7d7", "b1d1", "d7e7", "d1b1", "e7a3",
+    "a5b4", "a3a4", "b4d6", "f6g4", "c4c5", "a4d4", "b1c1", "g4f6", "c1c4", "d4a1", "c5c6", "b7c6", "b5c6", "a1a5", "g5e6", "e8e6"
+};
+
 class BenchEngine : public UciEngine {
 public:
     size_t nbNodes = 0;
@@ -92,6 +104,7 @@ void bench(int depth) {
         console << "go depth " << depth << std::endl;
 
         engine.newGame();
+        engine.transpositionTable()->waitForBackgroundTask(); // Keep the node count reproducible
         engine.position().setFromFEN(fen);
         engine.search(limits);
         engine.waitForSearchFinish();
@@ -100,6 +113,89 @@ void bench(int depth) {
     console << std::endl << "-----------------------------" << std::endl;
     console << "Elapsed: " << engine.elapsed << std::endl;
     console << engine.nbNodes << " nodes " << engine.nps() << " nps" << std::endl;
+    console << "Pawn hash hit rate: " << 100.0 * engine.pawnTableStats().hitRate() << "%, material: " << 100.0 * engine.materialTableStats().hitRate() << "%" << std::endl;
+}
+
+void benchGame(int depth) {
+    BenchEngine engine;
+    SearchLimits limits;
+    limits.maxDepth = depth;
+
+    engine.newGame();
+    engine.transpositionTable()->waitForBackgroundTask(); // Keep the node count reproducible
+    engine.position().setFromFEN(STARTPOS_FEN);
+
+    for (auto move : BENCH_GAME) {
+        console << "go depth " << depth << std::endl;
+
+        engine.search(limits);
+        engine.waitForSearchFinish();
+
+        console << "position moves " << move << std::endl;
+
+        enumerateLegalMoves(engine.position(), [&](Move m) {
+            if (Uci::formatMove(m) != move) return true;
+            engine.position().doMove(m);
+            return false;
+        });
+    }
+
+    console << std::endl << "-----------------------------" << std::endl;
+    console << "Elapsed: " << engine.elapsed << std::endl;
+    console << engine.nbNodes << " nodes " << engine.nps() << " nps" << std::endl;
+    console << "Pawn hash hit rate: " << 100.0 * engine.pawnTableStats().hitRate() << "%, material: " << 100.0 * engine.materialTableStats().hitRate() << "%" << std::endl;
+}
+
+// Walk of the legal move tree, evaluating every node when Eval is set
+template<bool Eval, Side Me>
+size_t evalWalk(Position &pos, EvalCache &cache, int depth, int64_t &checksum) {
+    if constexpr (Eval) checksum += evaluate<Me>(pos, cache);
+    if (depth == 0) return 1;
+
+    size_t nbNodes = 1;
+    enumerateLegalMoves<Me>(pos, [&](Move m) {
+        pos.doMove<Me>(m);
+        nbNodes += evalWalk<Eval, ~Me>(pos, cache, depth - 1, checksum);
+        pos.undoMove<Me>(m);
+        return true;
+    });
+
+    return nbNodes;
+}
+
+template<bool Eval>
+size_t evalWalk(Position &pos, EvalCache &cache, int depth, int64_t &checksum) {
+    return pos.getSideToMove() == WHITE ? evalWalk<Eval, WHITE>(pos, cache, depth, checksum) : evalWalk<Eval, BLACK>(pos, cache, depth, checksum);
+}
+
+void benchEval(int depth) {
+    Position pos;
+    auto cache = std::make_unique<EvalCache>();
+    size_t nbEvals = 0;
+    int64_t checksum = 0;
+    std::chrono::nanoseconds walkTime(0), evalTime(0);
+
+    // The same tree is walked without and with evaluation, the difference is the time spent in the evaluation
+    for (auto fen : BENCH_POSITIONS) {
+        pos.setFromFEN(fen);
+
+        auto start = std::chrono::steady_clock::now();
+        evalWalk<false>(pos, *cache, depth, checksum);
+        auto middle = std::chrono::steady_clock::now();
+        nbEvals += evalWalk<true>(pos, *cache, depth, checksum);
+        auto end = std::chrono::steady_clock::now();
+
+        walkTime += middle - start;
+        evalTime += end - middle;
+    }
+
+    double nsPerEval = double(std::max((evalTime - walkTime).count(), (int64_t)0)) / std::max(nbEvals, (size_t)1);
+
+    console << "Evaluations: " << nbEvals << std::endl;
+    console << "Checksum: " << checksum << std::endl;
+    console << "Walk: " << walkTime.count() / 1000000 << "ms, with evaluation: " << evalTime.count() / 1000000 << "ms" << std::endl;
+    console << nsPerEval << " ns/eval" << std::endl;
+    console << "Pawn hash hit rate: " << 100.0 * cache->pawns.getStats().hitRate() << "%, material: " << 100.0 * cache->material.getStats().hitRate() << "%" << std::endl;
 }
 
 } /* namespace Belette  */
\ No newline at end of file
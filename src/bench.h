@@ -4,8 +4,12 @@
 namespace Belette {
 
 constexpr int DEFAULT_BENCH_DEPTH = 13;
+constexpr int DEFAULT_BENCH_GAME_DEPTH = 10;
+constexpr int DEFAULT_BENCH_EVAL_DEPTH = 4;
 
 void bench(int depth);
+void benchGame(int depth); // "bench game": searches the positions of a game in sequence
+void benchEval(int depth); // "bench eval": evaluates every node of the perft trees of the bench positions
     
 } /* namespace Belette */
 
@@ -98,6 +98,32 @@ inline Bitboard attacks(Square sq, Bitboard occupied = 0) {
     if constexpr (Pt == QUEEN) return sliderAttacks<BISHOP>(sq, occupied) | sliderAttacks<ROOK>(sq, occupied);
 }
 
+// The bitboard and every square in front of its bits, from the point of view of Me
+template<Side Me>
+constexpr Bitboard forwardFill(Bitboard b) {
+    if constexpr (Me == WHITE) {
+        b |= b << 8; b |= b << 16; b |= b << 32;
+    } else {
+        b |= b >> 8; b |= b >> 16; b |= b >> 32;
+    }
+    return b;
+}
+
+// Squares strictly in front of the bits
+template<Side Me>
+constexpr Bitboard frontSpan(Bitboard b) {
+    return Me == WHITE ? shift<UP>(forwardFill<Me>(b)) : shift<DOWN>(forwardFill<Me>(b));
+}
+
+constexpr Bitboard fileFill(Bitboard b) {
+    return forwardFill<WHITE>(b) | forwardFill<BLACK>(b);
+}
+
+constexpr Bitboard adjacentFiles(Bitboard b) {
+    Bitboard files = fileFill(b);
+    return shift<LEFT>(files) | shift<RIGHT>(files);
+}
+
 inline Bitboard betweenBB(Square from, Square to) {
     assert(isValidSq(from) && isValidSq(to));
     return BETWEEN_BB[from][to];
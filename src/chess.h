@@ -8,8 +8,9 @@
 namespace Belette {
 
 constexpr int MAX_PLY = 128;
-constexpr int MAX_HISTORY   = 2048;
+constexpr int MAX_HISTORY   = 256; // Ring of States: 100 plies of the fifty move rule, plus the search plies
 constexpr int MAX_MOVE   = 220;
+constexpr int MAX_THREADS = 256;
 
 using Bitboard = uint64_t;
 constexpr Bitboard EmptyBB = 0ULL;
@@ -132,6 +133,11 @@ enum Phase {
     NB_PHASE = 2
 };
 
+// Middle game and end game scores packed in one int, the end game one in the upper half, so both are updated with one addition
+enum ScorePair : int {
+    SCORE_PAIR_ZERO
+};
+
 constexpr Bitboard FileABB = 0x0101010101010101ULL;
 constexpr Bitboard FileBBB = FileABB << 1;
 constexpr Bitboard FileCBB = FileABB << 2;
@@ -181,6 +187,13 @@ constexpr CastlingRight operator&(Side s, CastlingRight cr) { return CastlingRig
 
 constexpr Side operator~(Side c) { return Side(c ^ BLACK); }
 
+constexpr ScorePair operator+(ScorePair s1, ScorePair s2) { return ScorePair(int(s1) + int(s2)); }
+constexpr ScorePair operator-(ScorePair s1, ScorePair s2) { return ScorePair(int(s1) - int(s2)); }
+constexpr ScorePair operator-(ScorePair s) { return ScorePair(-int(s)); }
+constexpr ScorePair operator*(ScorePair s, int i) { return ScorePair(int(s) * i); }
+inline ScorePair& operator+=(ScorePair& s1, ScorePair s2) { return s1 = s1 + s2; }
+inline ScorePair& operator-=(ScorePair& s1, ScorePair s2) { return s1 = s1 - s2; }
+
 
 constexpr Square CastlingKingTo[NB_CASTLING_RIGHT] = {
     SQ_NONE, // NO_CASTLING
@@ -243,6 +256,18 @@ constexpr Bitboard CastlingKingPath[NB_CASTLING_RIGHT] = {
     bb(SQ_E8) | bb(SQ_D8) | bb(SQ_C8)   // BLACK_QUEEN_SIDE = 8,
 };
 
+constexpr ScorePair makeScorePair(Score mg, Score eg) {
+    return ScorePair(int(unsigned(eg) << 16) + mg);
+}
+
+constexpr Score mgScore(ScorePair s) {
+    return int16_t(uint16_t(unsigned(s)));
+}
+
+constexpr Score egScore(ScorePair s) {
+    return int16_t(uint16_t((unsigned(s) + 0x8000) >> 16)); // Undo the borrow of a negative middle game score
+}
+
 constexpr bool isValidSq(Square s) {
     return s >= SQ_A1 && s <= SQ_H8;
 }
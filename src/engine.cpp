@@ -18,133 +18,474 @@ void Engine::init() {
     }
 }
 
-void updatePv(MoveList &pv, Move move, const MoveList &childPv) {
-    pv.clear();
-    pv.push_back(move);
-    pv.insert(childPv.begin(), childPv.end());
+// Triangular PV table: the PV of a ply is its move followed by the PV of the next ply
+inline void updatePv(SearchStack *ss, int ply, Move move) {
+    int length = ss[1].pvLength;
+
+    ss->pv[ply] = move;
+    std::copy(&ss[1].pv[ply+1], &ss[1].pv[length], &ss->pv[ply+1]);
+    ss->pvLength = length;
 }
 
-void SearchData::initAllocatedTime() {
-    int64_t moves = limits.movesToGo > 0 ? limits.movesToGo : 40;
-    Side stm = position.getSideToMove();
+Engine::Engine(): Engine(std::make_shared<TranspositionTable>()) { }
 
-    allocatedTime = limits.timeLeft[stm] / moves + limits.increment[stm];
+Engine::Engine(std::shared_ptr<TranspositionTable> tt_): tt(tt_) {
+    startThreads(1);
+    timerThread = std::thread(&Engine::timerLoop, this);
 }
 
-void Engine::waitForSearchFinish() {
-    // TODO: use condition variable ?
-    while (isSearching()) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+Engine::~Engine() {
+    stop();
+    waitForSearchFinish();
+    stopThreads();
+
+    {
+        std::lock_guard<std::mutex> lock(timerMutex);
+        timerExiting = true;
+    }
+    timerCondition.notify_one();
+    timerThread.join();
+}
+
+void Engine::startThreads(int n) {
+    moveHistories.clear();
+    evalCaches.clear();
+    threadsData.clear();
+    for (int i = 0; i < n; i++) {
+        moveHistories.push_back(std::make_unique<MoveHistory>());
+        evalCaches.push_back(std::make_unique<EvalCache>());
+        threadsData.push_back(std::make_unique<SearchData>(*tt, *moveHistories[i], *evalCaches[i], i));
+    }
+
+    // New workers must not run the last search again, they wait for the next one
+    uint64_t currentSearchId;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        currentSearchId = searchId;
+    }
+
+    for (int i = 0; i < n; i++) {
+        threads.emplace_back(&Engine::threadLoop, this, i, currentSearchId);
+    }
+}
+
+void Engine::stopThreads() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        exiting = true;
+    }
+    startCondition.notify_all();
+
+    for (auto &th : threads) th.join();
+
+    threads.clear();
+    exiting = false;
+}
+
+void Engine::setNbThreads(int n) {
+    n = std::clamp(n, 1, MAX_THREADS);
+    if (n == getNbThreads()) return;
+
+    waitForSearchFinish();
+    stopThreads();
+    startThreads(n);
+}
+
+// Worker loop: sleep until a new search is started or the pool is destroyed
+void Engine::threadLoop(int threadId, uint64_t lastSearchId) {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            startCondition.wait(lock, [&] { return exiting || searchId != lastSearchId; });
+
+            if (exiting) return;
+            lastSearchId = searchId;
+        }
+
+        if (threadId == 0) {
+            mainSearch();
+        } else {
+            idSearch(*threadsData[threadId]);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            nbHelpersRunning--;
+            helpersCondition.notify_one();
+        }
+    }
+}
+
+// Deadlines of the current search. The optimum counts from the start of the search, time spent pondering
+// is thinking time too, the maximum from the moment our clock started
+void Engine::armTimer() {
+    SearchData &mainData = *threadsData[0];
+
+    if (mainData.useTournamentTime()) {
+        setTimer(mainData.startTime + timeManager.scaledOptimum(), clockStart + timeManager.maximum());
+    } else if (mainData.useFixedTime()) {
+        setTimer(0, clockStart + mainData.limits.maxTime);
+    }
+}
+
+// Arm the timer for the current search, or disarm it with (0, 0)
+void Engine::setTimer(TimeMs soft, TimeMs hard) {
+    {
+        std::lock_guard<std::mutex> lock(timerMutex);
+        softDeadline = soft;
+        hardDeadline = hard;
+        softStop = false;
     }
+    timerCondition.notify_one();
+}
+
+void Engine::timerLoop() {
+    std::unique_lock<std::mutex> lock(timerMutex);
+
+    while (!timerExiting) {
+        if (!softDeadline && !hardDeadline) {
+            timerCondition.wait(lock);
+            continue;
+        }
+
+        TimeMs deadline = softDeadline ? softDeadline : hardDeadline; // Soft deadline is never after the hard one
+
+        // Deadlines may have changed while waiting, so always loop to check them again
+        if (now() < deadline) {
+            timerCondition.wait_until(lock, std::chrono::steady_clock::time_point(std::chrono::milliseconds(deadline)));
+            continue;
+        }
+
+        if (deadline == softDeadline) {
+            softDeadline = 0;
+            softStop = true;
+        } else {
+            hardDeadline = 0;
+            reachedDeadline = deadline;
+            stop();
+        }
+    }
+}
+
+void Engine::waitForSearchFinish() {
+    std::unique_lock<std::mutex> lock(mutex);
+    finishCondition.wait(lock, [&] { return !searching; });
+}
+
+// Move ordering history is kept between the searches of a game, not between games
+void Engine::newGame() {
+    clearHash();
+    for (auto &moveHistory : moveHistories) moveHistory->clear();
 }
 
 // Search entry point
 void Engine::search(const SearchLimits &limits) {
+    // "bestmove" is sent just before the search is marked as finished, so a fast GUI can start the next one in between
+    if (searching && searchAborted()) waitForSearchFinish();
     if (searching) return;
 
-    sd = std::make_unique<SearchData>(position(), limits);
+    for (int i = 0; i < getNbThreads(); i++) {
+        moveHistories[i]->age();
+        threadsData[i]->init(position(), limits);
+        threadsData[i]->multiPV = std::clamp<size_t>(threadsData[i]->rootMoves.size(), 1, multiPV);
+    }
+
     aborted = false;
+    softStop = false;
+    reachedDeadline = 0;
+    pondering = limits.ponder;
     searching = true;
+
+    // Time limits only apply once the opponent played the expected move
+    SearchData &mainData = *threadsData[0];
+    clockStart = mainData.startTime;
+
+    if (mainData.useTournamentTime()) {
+        Side stm = position().getSideToMove();
+        timeManager.init(limits.timeLeft[stm], limits.increment[stm], limits.movesToGo, moveOverhead);
+    }
+
+    if (!pondering) armTimer();
     
-    tt.newSearch();
+    if (!tt->allocated()) tt->clear(getNbThreads());
+    tt->newSearch();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        nbHelpersRunning = getNbThreads() - 1;
+        searchId++;
+    }
+    startCondition.notify_all();
+}
+
+// The opponent played the expected move: the ponder search goes on as a normal timed search.
+// The time spent pondering counts toward the optimum time but not toward the maximum, our clock only starts now
+void Engine::ponderHit() {
+    if (!searching || !pondering) return;
+
+    clockStart = now();
 
-    std::thread th([&] { 
-        this->idSearch();
-    });
-    th.detach();
+    // The main thread may be updating the scaled optimum, use the initial one until its next iteration
+    SearchData &mainData = *threadsData[0];
+    if (mainData.useTournamentTime()) {
+        setTimer(mainData.startTime + timeManager.optimum(), clockStart + timeManager.maximum());
+    } else if (mainData.useFixedTime()) {
+        setTimer(0, clockStart + mainData.limits.maxTime);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pondering = false;
+    }
+    ponderCondition.notify_all();
 }
 
 void Engine::stop() {
-    aborted = true;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        aborted = true;
+    }
+    ponderCondition.notify_all();
+}
+
+size_t Engine::getNodes() const {
+    size_t nodes = 0;
+    for (auto &sd : threadsData) nodes += sd->getNodes();
+    return nodes;
 }
 
+// Counters are not synchronized, only read them when no search is running
+EvalTableStats Engine::pawnTableStats() const {
+    EvalTableStats stats;
+    for (auto &cache : evalCaches) stats += cache->pawns.getStats();
+    return stats;
+}
+
+EvalTableStats Engine::materialTableStats() const {
+    EvalTableStats stats;
+    for (auto &cache : evalCaches) stats += cache->material.getStats();
+    return stats;
+}
+
+// Time limits are handled by the timer thread, only the node limit is left here
+bool Engine::shouldStop(SearchData &sd) {
+    // Limits are only checked by the main thread, helpers are stopped by it
+    if (!sd.useNodeCountLimit() || !sd.isMainThread()) return false;
+
+    // Summing the nodes of all threads is not free, check every 1024 nodes
+    if (sd.getNodes() % 1024 != 0)  return false;
+    
+    return getNodes() >= sd.limits.maxNodes;
+}
+
+// Lazy SMP: every thread searches the same root position and they only share the transposition table
+void Engine::mainSearch() {
+    SearchData &mainData = *threadsData[0];
+
+    idSearch(mainData);
+    bool interrupted = searchAborted();
+
+    // The UCI protocol forbids to send the best move of a ponder or infinite search before "ponderhit" or "stop"
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ponderCondition.wait(lock, [&] { return searchAborted() || (!pondering && !mainData.limits.infinite); });
+    }
+
+    // Main thread is done, stop helpers
+    setTimer(0, 0);
+    stop();
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        helpersCondition.wait(lock, [&] { return nbHelpersRunning == 0; });
+    }
+
+    SearchData &best = pickBestThread();
+
+    // Report final result if it has not been reported by the main thread
+    SearchEvent event(best.completedDepth, best.selDepth, best.bestPv, best.bestScore, getNodes(), mainData.getElapsed(), tt->usage());
+    if (interrupted || &best != &mainData)
+        onSearchProgress(event);
+    onSearchFinish(event);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        searching = false;
+    }
+    finishCondition.notify_all();
+}
+
+// Prefer the deepest completed iteration, then the best score
+SearchData &Engine::pickBestThread() {
+    SearchData *best = threadsData[0].get();
+
+    for (auto &sd : threadsData) {
+        if (sd->bestPv.empty()) continue;
+
+        if (sd->completedDepth > best->completedDepth
+            || (sd->completedDepth == best->completedDepth && sd->bestScore > best->bestScore))
+        {
+            best = sd.get();
+        }
+    }
+
+    return *best;
+}
+
+// Helper threads skip some depths so they don't all search the same iteration (from old stockfish)
+constexpr int SKIP_SIZE[20]  = {1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4};
+constexpr int SKIP_PHASE[20] = {0, 1, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 6, 7};
+
 // Iterative deepening loop
 template<Side Me>
-void Engine::idSearch() {
-    MoveList bestPv;
-    Score bestScore;
-    int depth, searchDepth, completedDepth = 0;
+void Engine::idSearch(SearchData &sd) {
+    int depth, searchDepth;
+
+    // Before the first iteration, root moves are in move picker order: TT move, captures, killers & history
+    {
+        auto&&[ttHit, tte, ttSlot] = sd.tt.get(sd.position.hash());
+        MovePicker<MAIN, Me> mp(sd.position, sd.stack[0].moves, ttHit ? tte.move() : MOVE_NONE, &sd.moveHistory, sd.stack[0].killers, &sd.tt);
+        size_t n = 0;
+
+        mp.enumerate([&](Move move, bool&) {
+            auto it = std::find(sd.rootMoves.begin() + n, sd.rootMoves.end(), move);
+            if (it != sd.rootMoves.end()) std::rotate(sd.rootMoves.begin() + n++, it, it + 1);
+            return true;
+        });
+    }
 
     for (depth = 1; depth < MAX_PLY; depth++) {
-        Score alpha = -SCORE_INFINITE, beta = SCORE_INFINITE;
-        Score delta, score;
-        MoveList pv;
+        Score delta, score = -SCORE_INFINITE;
+        TimeMs iterationStart = sd.getElapsed();
+        size_t iterationNodes = sd.getNodes();
+
+        // Depth diversification for helper threads
+        if (!sd.isMainThread() && depth > 1) {
+            int i = (sd.threadId - 1) % 20;
+            if (((depth + SKIP_PHASE[i]) / SKIP_SIZE[i]) % 2) continue;
+        }
 
-        // Reset selDepth
-        sd->selDepth = 0;
+        for (RootMove &rm : sd.rootMoves) {
+            rm.previousScore = rm.score;
+            rm.nodes = 0;
+        }
 
-        searchDepth = depth;
+        // MultiPV: each line is searched without the moves of the previous ones, all of them share the TT
+        for (sd.pvIdx = 0; sd.pvIdx < sd.multiPV; sd.pvIdx++) {
+            Score alpha = -SCORE_INFINITE, beta = SCORE_INFINITE;
+            Score previousScore = sd.pvIdx < sd.rootMoves.size() ? sd.rootMoves[sd.pvIdx].previousScore : -SCORE_INFINITE;
 
-        // Aspiration window
-        if (depth > 4) {
-            delta = 16 + std::abs(bestScore)/100;
-            alpha = std::max(-SCORE_INFINITE, bestScore - delta);
-            beta  = std::min( SCORE_INFINITE, bestScore + delta);
-        }
+            // Reset selDepth
+            sd.selDepth = 0;
 
-        while (true) {
-            if (alpha < -1000) alpha = -SCORE_INFINITE;
-            if (beta > 1000) beta = SCORE_INFINITE;
-            //std::cout << "  depth=" << searchDepth << " d=" << delta << std::endl;
-            score = pvSearch<Me, NodeType::Root>(alpha, beta, searchDepth, 0, pv, false);
+            searchDepth = depth;
 
-            if (searchAborted()) break;
+            // Aspiration window around the score of this line, slightly different for each helper thread
+            if (depth > 4 && previousScore != -SCORE_INFINITE) {
+                delta = 16 + std::abs(previousScore)/100 + 2 * (sd.threadId % 4);
+                alpha = std::max(-SCORE_INFINITE, previousScore - delta);
+                beta  = std::min( SCORE_INFINITE, previousScore + delta);
+            }
 
-            if (score <= alpha) { // Fail low
-                //std::cout << "  Fail Low: a=" << alpha << " b=" << beta << " score=" << score << std::endl;
-                beta = (alpha + beta) / 2;
-                alpha = std::max(score - delta, -SCORE_INFINITE);
-                searchDepth = depth;
-            } else if (score >= beta) { // Fail high
-                //std::cout << "  Fail High: a=" << alpha << " b=" << beta << " score=" << score << std::endl;
-                beta = std::min(score + delta, SCORE_INFINITE);
-                //searchDepth = std::max(std::max(1, depth - 4), searchDepth - 1);
-                searchDepth -= (std::abs(score) < 1000);
-            } else {
-                break;
+            while (true) {
+                if (alpha < -1000) alpha = -SCORE_INFINITE;
+                if (beta > 1000) beta = SCORE_INFINITE;
+                //std::cout << "  depth=" << searchDepth << " d=" << delta << std::endl;
+                score = pvSearch<Me, NodeType::Root>(sd, alpha, beta, searchDepth, 0, false);
+
+                // Best move of the remaining ones becomes the current line, the others are the order of the next search
+                std::stable_sort(sd.rootMoves.begin() + sd.pvIdx, sd.rootMoves.end());
+
+                if (searchAborted()) break;
+
+                if (score <= alpha) { // Fail low
+                    //std::cout << "  Fail Low: a=" << alpha << " b=" << beta << " score=" << score << std::endl;
+                    beta = (alpha + beta) / 2;
+                    alpha = std::max(score - delta, -SCORE_INFINITE);
+                    searchDepth = depth;
+                } else if (score >= beta) { // Fail high
+                    //std::cout << "  Fail High: a=" << alpha << " b=" << beta << " score=" << score << std::endl;
+                    beta = std::min(score + delta, SCORE_INFINITE);
+                    //searchDepth = std::max(std::max(1, depth - 4), searchDepth - 1);
+                    searchDepth -= (std::abs(score) < 1000);
+                } else {
+                    break;
+                }
+
+                delta += delta / 2;
             }
 
-            delta += delta / 2;
+            if (searchAborted()) break;
+
+            // Lines found so far, in order
+            std::stable_sort(sd.rootMoves.begin(), sd.rootMoves.begin() + std::min(sd.pvIdx + 1, sd.rootMoves.size()));
         }
 
-        if (depth > 1 && searchAborted()) break;
+        // Main thread always keeps the first iteration, so there is a move to play
+        if (searchAborted() && (depth > 1 || !sd.isMainThread())) break;
 
-        bestPv = pv;
-        bestScore = score;
-        completedDepth = depth;
+        // Without legal move there is no line, only the mate or stalemate score
+        if (!sd.rootMoves.empty()) {
+            sd.bestPv = sd.rootMoves[0].pv;
+            sd.bestScore = sd.rootMoves[0].score;
+        } else {
+            sd.bestPv.clear();
+            sd.bestScore = score;
+        }
+        sd.completedDepth = depth;
 
-        onSearchProgress(SearchEvent(depth, sd->selDepth, pv, bestScore, sd->nbNodes, sd->getElapsed(), tt.usage()));
+        if (sd.isMainThread()) {
+            if (sd.rootMoves.empty()) {
+                onSearchProgress(SearchEvent(depth, sd.selDepth, sd.bestPv, sd.bestScore, getNodes(), sd.getElapsed(), tt->usage()));
+            }
+            for (size_t i = 0; i < sd.multiPV && i < sd.rootMoves.size(); i++) {
+                const RootMove &rm = sd.rootMoves[i];
+                onSearchProgress(SearchEvent(depth, rm.selDepth, rm.pv, rm.score, getNodes(), sd.getElapsed(), tt->usage(), i + 1));
+            }
+        }
 
-        if (sd->limits.maxDepth > 0 && depth >= sd->limits.maxDepth) break;
-    }
+        if (sd.limits.maxDepth > 0 && depth >= sd.limits.maxDepth) break;
 
-    SearchEvent event(depth, sd->selDepth, bestPv, bestScore, sd->nbNodes, sd->getElapsed(), tt.usage());
-    if (depth != completedDepth)
-        onSearchProgress(event);
-    onSearchFinish(event);
+        if (sd.isMainThread() && sd.useTournamentTime()) {
+            TimeMs elapsed = sd.getElapsed();
+            size_t bestMoveNodes = sd.rootMoves.empty() ? 0 : sd.rootMoves[0].nodes;
+            double bestMoveNodeShare = double(bestMoveNodes) / std::max<size_t>(1, sd.getNodes() - iterationNodes);
+
+            timeManager.update(depth, sd.bestPv.empty() ? MOVE_NONE : sd.bestPv.front(), sd.bestScore, bestMoveNodeShare);
+
+            if (!pondering) {
+                armTimer();
+                if (!timeManager.canStartIteration(elapsed, now() - clockStart, elapsed - iterationStart)) break;
+            }
+        }
+
+        // Soft deadline reached, don't start a new iteration
+        if (sd.isMainThread() && softStop.load(std::memory_order_relaxed)) break;
+    }
 
-    searching = false;
 }
 
 // Negamax search
 template<Side Me, NodeType NT>
-Score Engine::pvSearch(Score alpha, Score beta, int depth, int ply, MoveList &pv, bool cutNode) {
+Score Engine::pvSearch(SearchData &sd, Score alpha, Score beta, int depth, int ply, bool cutNode) {
     constexpr bool PvNode = (NT != NodeType::NonPV);
     constexpr bool RootNode = (NT == NodeType::Root);
     constexpr NodeType QNodeType = PvNode ? NodeType::PV : NodeType::NonPV;
 
     // Quiescence
     if (depth <= 0) {
-        return qSearch<Me, QNodeType>(alpha, beta, depth, ply);
+        return qSearch<Me, QNodeType>(sd, alpha, beta, depth, ply);
+    }
+
+    // Empty PV, until a move raises alpha
+    if (PvNode) {
+        sd.stack[ply].pvLength = ply;
     }
 
     // Update selDepth
-    if (PvNode && sd->selDepth < ply + 1) {
-        sd->selDepth = ply + 1;
+    if (PvNode && sd.selDepth < ply + 1) {
+        sd.selDepth = ply + 1;
     }
 
     // Check if we should stop according to limits
-    if (!RootNode && sd->shouldStop()) [[unlikely]] {
+    if (!RootNode && shouldStop(sd)) [[unlikely]] {
         stop();
     }
 
@@ -164,45 +505,57 @@ Score Engine::pvSearch(Score alpha, Score beta, int depth, int ply, MoveList &pv
     Score alphaOrig = alpha;
     Score bestScore = -SCORE_INFINITE;
     Move bestMove = MOVE_NONE;
-    Position &pos = sd->position;
+    Position &pos = sd.position;
+    SearchStack *ss = &sd.stack[ply];
     bool inCheck = pos.inCheck();
     Score eval = SCORE_NONE;
-    MoveList childPv;
+    bool improving = false;
 
-    if (pos.isFiftyMoveDraw() || pos.isMaterialDraw() || pos.isRepetitionDraw()) {
+    // Not at the root: there must be a move to play even if the GUI goes on after a draw
+    if (!RootNode && (pos.isFiftyMoveDraw() || pos.isMaterialDraw() || pos.isRepetitionDraw())) {
         // "Random" either -1 or 1, avoid blindness to 3-fold repetitions
-        return 1-(sd->nbNodes & 2);
+        return 1-(sd.getNodes() & 2);
         //return SCORE_DRAW;
     }
 
     if (ply >= MAX_PLY) [[unlikely]] {
-        return evaluate<Me>(pos); // TODO: verify if we are in check ?
+        return evaluate<Me>(pos, sd.evalCache); // TODO: verify if we are in check ?
     }
 
     // Query Transposition Table
-    auto&&[ttHit, tte] = tt.get(pos.hash());
-    Score ttScore = tte->score(ply);
-    bool ttPv = PvNode || (ttHit && tte->isPv());
-    Move ttMove = ttHit ? tte->move() : MOVE_NONE;
+    auto&&[ttHit, tte, ttSlot] = sd.tt.get(pos.hash());
+    Score ttScore = tte.score(ply);
+    bool ttPv = PvNode || (ttHit && tte.isPv());
+    Move ttMove = ttHit ? tte.move() : MOVE_NONE;
     bool ttTactical = ttHit ? pos.isTactical(ttMove) : false;
 
     // Transposition Table cutoff
-    if (!PvNode && ttHit && tte->depth() >= depth && tte->canCutoff(ttScore, beta)) {
+    if (!PvNode && ttHit && tte.depth() >= depth && tte.canCutoff(ttScore, beta)) {
         return ttScore;
     }
 
     // Static eval
+    ss->inCheck = inCheck;
+    ss->staticEval = SCORE_NONE;
+
     if (!inCheck) {
         if (ttHit) {
-            eval = (tte->eval() != SCORE_NONE ? tte->eval() : evaluate<Me>(pos));
+            eval = ss->staticEval = (tte.eval() != SCORE_NONE ? tte.eval() : evaluate<Me>(pos, sd.evalCache));
 
             // Use score instead of eval if available. 
-            if (tte->canCutoff(ttScore, eval)) {
-                eval = tte->score(ply);
+            if (tte.canCutoff(ttScore, eval)) {
+                eval = tte.score(ply);
             }
         } else {
-            eval = evaluate<Me>(pos);
-            tt.set(tte, pos.hash(), 0, ply, BOUND_NONE, MOVE_NONE, eval, SCORE_NONE, ttPv);
+            eval = ss->staticEval = evaluate<Me>(pos, sd.evalCache);
+            sd.tt.set(ttSlot, pos.hash(), 0, ply, BOUND_NONE, MOVE_NONE, eval, SCORE_NONE, ttPv);
+        }
+
+        // Improving: static eval is better than on our previous move (or the one before if we were in check)
+        if (ply >= 2 && !ss[-2].inCheck) {
+            improving = ss->staticEval > ss[-2].staticEval;
+        } else if (ply >= 4 && !ss[-4].inCheck) {
+            improving = ss->staticEval > ss[-4].staticEval;
         }
     }
 
@@ -211,9 +564,9 @@ Score Engine::pvSearch(Score alpha, Score beta, int depth, int ply, MoveList &pv
         depth--;
     }
 
-    // Reverse futility pruning (RFP)
+    // Reverse futility pruning (RFP), smaller margin when improving
     if (!PvNode && !inCheck && depth <= 4
-        && eval - (100 * depth) >= beta)
+        && eval - (100 * depth - 50 * improving) >= beta)
     {
         return eval;
     }
@@ -222,7 +575,7 @@ Score Engine::pvSearch(Score alpha, Score beta, int depth, int ply, MoveList &pv
     if (!PvNode && !inCheck && depth <= 2
         && eval + (400 * depth) <= alpha)
     {
-        Score score = qSearch<Me, QNodeType>(alpha, beta, depth, ply);
+        Score score = qSearch<Me, QNodeType>(sd, alpha, beta, depth, ply);
         if (score <= alpha)
             return score;
     }
@@ -231,11 +584,11 @@ Score Engine::pvSearch(Score alpha, Score beta, int depth, int ply, MoveList &pv
     if (!PvNode && !inCheck
         && pos.previousMove() != MOVE_NULL && pos.hasNonPawnMateriel<Me>() && eval >= beta)
     {
-        tt.prefetch(pos.getHashAfterNullMove());
+        sd.tt.prefetch(pos.getHashAfterNullMove());
         int R = 4 + depth / 4;
 
         pos.doNullMove<Me>();
-        Score score = -pvSearch<~Me, NodeType::NonPV>(-beta, -beta+1, depth-R, ply+1, childPv, !cutNode);
+        Score score = -pvSearch<~Me, NodeType::NonPV>(sd, -beta, -beta+1, depth-R, ply+1, !cutNode);
         pos.undoNullMove<Me>();
 
         if (score >= beta) {
@@ -249,25 +602,22 @@ Score Engine::pvSearch(Score alpha, Score beta, int depth, int ply, MoveList &pv
         depth++;
     }
 
-    sd->moveHistory.clearKillers(ply+1);
+    ss[1].killers[0] = ss[1].killers[1] = MOVE_NONE;
 
     int nbMoves = 0;
-    MovePicker<MAIN, Me> mp(pos, ttMove, &sd->moveHistory, ply);
+    MovePicker<MAIN, Me> mp(pos, ss->moves, ttMove, &sd.moveHistory, ss->killers, &sd.tt);
     PartialMoveList quietMoves;
+    RootMove *rootMove = nullptr;
     
-    mp.enumerate([&](Move move, bool& skipQuiets) -> bool {
-        // Honor UCI searchmoves
-        if (RootNode && sd->limits.searchMoves.size() > 0 && !sd->limits.searchMoves.contains(move))
-            return true; // continue
-
+    auto searchMove = [&](Move move, bool& skipQuiets) -> bool {
         nbMoves++;
 
         bool moveIsTactical = pos.isTactical(move);
 
         // Late move pruning
         if (!RootNode && bestScore > -SCORE_MATE_MAX_PLY) {
-            // Move count pruning
-            skipQuiets = (nbMoves >= 3 + depth*depth);
+            // Move count pruning, twice as many moves when improving
+            skipQuiets = (nbMoves >= (3 + depth*depth) / (2 - improving));
 
             // SEE Pruning
             if (depth <= 8 && !pos.see(move, moveIsTactical ? -100*depth : -60*depth)) {
@@ -276,12 +626,13 @@ Score Engine::pvSearch(Score alpha, Score beta, int depth, int ply, MoveList &pv
         }
 
         // Prefetch TT
-        tt.prefetch(pos.getHashAfter(move));
+        sd.tt.prefetch(pos.getHashAfter(move));
 
-        sd->nbNodes++;
+        sd.incNodes();
+        size_t nodesBefore = RootNode ? sd.getNodes() : 0;
 
         if (PvNode)
-            childPv.clear();
+            ss[1].pvLength = ply+1;
 
         // Do move
         pos.doMove<Me>(move);
@@ -297,27 +648,28 @@ Score Engine::pvSearch(Score alpha, Score beta, int depth, int ply, MoveList &pv
             R += !ttPv;
             R += ttTactical;
             R += 2*cutNode;
-            R -= sd->moveHistory.getHistory<Me>(move) / 2048;
+            R += !improving;
+            R -= sd.moveHistory.getHistory<Me>(move) / 2048;
 
 
             R = std::min(depth - 1, std::max(1, R));
 
             // Reduced depth, Zero window
-            score = -pvSearch<~Me, NodeType::NonPV>(-alpha-1, -alpha, depth-R, ply+1, childPv, true);
+            score = -pvSearch<~Me, NodeType::NonPV>(sd, -alpha-1, -alpha, depth-R, ply+1, true);
 
             if (score > alpha && R != 1) {
                 // Full depth, Zero window
-                score = -pvSearch<~Me, NodeType::NonPV>(-alpha-1, -alpha, depth-1, ply+1, childPv, !cutNode);
+                score = -pvSearch<~Me, NodeType::NonPV>(sd, -alpha-1, -alpha, depth-1, ply+1, !cutNode);
             }
 
         } else if (!PvNode || nbMoves > 1) {
             // Zero window (PVS)
-            score = -pvSearch<~Me, NodeType::NonPV>(-alpha-1, -alpha, depth-1, ply+1, childPv, !cutNode);
+            score = -pvSearch<~Me, NodeType::NonPV>(sd, -alpha-1, -alpha, depth-1, ply+1, !cutNode);
         }
 
         if (PvNode && (nbMoves == 1 || (score > alpha && (RootNode || score < beta)))) {
             // Full window (PVS)
-            score = -pvSearch<~Me, NodeType::PV>(-beta, -alpha, depth-1, ply+1, childPv, false);
+            score = -pvSearch<~Me, NodeType::PV>(sd, -beta, -alpha, depth-1, ply+1, false);
         }
 
         // Undo move
@@ -325,17 +677,34 @@ Score Engine::pvSearch(Score alpha, Score beta, int depth, int ply, MoveList &pv
 
         if (searchAborted()) return false; // break
 
+        // Moves failing low only get an upper bound, they are sorted after the others
+        if (RootNode) {
+            rootMove->nodes += sd.getNodes() - nodesBefore;
+
+            if (nbMoves == 1 || score > alpha) {
+                rootMove->score = score;
+                rootMove->selDepth = sd.selDepth;
+                rootMove->pv.clear();
+                rootMove->pv.push_back(move);
+                rootMove->pv.insert(&sd.stack[1].pv[1], &sd.stack[1].pv[sd.stack[1].pvLength]);
+            } else {
+                rootMove->score = -SCORE_INFINITE;
+            }
+        }
+
         if (score > bestScore) {
             bestScore = score;
             
             if (bestScore > alpha) {
                 bestMove = move;
                 alpha = bestScore;
+
                 if (PvNode)
-                    updatePv(pv, move, childPv);
+                    updatePv(ss, ply, move);
 
                 if (alpha >= beta) {
-                    sd->moveHistory.update<Me>(pos, bestMove, ply, depth, quietMoves);
+                    if (!pos.isTactical(bestMove)) ss->updateKillers(bestMove);
+                    sd.moveHistory.update<Me>(pos, bestMove, depth, quietMoves);
                     return false; // break
                 }
             }
@@ -346,7 +715,19 @@ Score Engine::pvSearch(Score alpha, Score beta, int depth, int ply, MoveList &pv
         }
 
         return true;
-    }); if (searchAborted()) return bestScore;
+    };
+
+    // Root moves are searched in the order of the root move list, without the lines already searched (MultiPV)
+    if constexpr (RootNode) {
+        bool skipQuiets = false;
+        for (size_t i = sd.pvIdx; i < sd.rootMoves.size(); i++) {
+            rootMove = &sd.rootMoves[i];
+            if (!searchMove(rootMove->move, skipQuiets)) break;
+        }
+    } else {
+        mp.enumerate(searchMove);
+    }
+    if (searchAborted()) return bestScore;
 
     // Checkmate / Stalemate detection
     if (nbMoves == 0) {
@@ -356,18 +737,18 @@ Score Engine::pvSearch(Score alpha, Score beta, int depth, int ply, MoveList &pv
     // Update Transposition Table
     Bound ttBound =         bestScore >= beta         ? BOUND_LOWER : 
                     !PvNode || bestScore <= alphaOrig ? BOUND_UPPER : BOUND_EXACT;
-    tt.set(tte, pos.hash(), depth, ply, ttBound, bestMove, SCORE_NONE, bestScore, ttPv);
+    sd.tt.set(ttSlot, pos.hash(), depth, ply, ttBound, bestMove, SCORE_NONE, bestScore, ttPv);
 
     return bestScore;
 }
 
 // Quiescence search
 template<Side Me, NodeType NT>
-Score Engine::qSearch(Score alpha, Score beta, int depth, int ply) {
+Score Engine::qSearch(SearchData &sd, Score alpha, Score beta, int depth, int ply) {
     constexpr bool PvNode = (NT != NodeType::NonPV);
 
     // Check if we should stop according to limits
-    if (sd->shouldStop()) [[unlikely]] {
+    if (shouldStop(sd)) [[unlikely]] {
         stop();
     }
 
@@ -379,44 +760,44 @@ Score Engine::qSearch(Score alpha, Score beta, int depth, int ply) {
     // Default bestScore for mate detection, if InCheck and there is no move this score will be returned
     Score bestScore = -SCORE_MATE + ply;
     Move bestMove = MOVE_NONE;
-    Position &pos = sd->position;
+    Position &pos = sd.position;
 
     if (pos.isFiftyMoveDraw() || pos.isMaterialDraw() || pos.isRepetitionDraw()) {
         // "Random" either -1 or 1, avoid blindness to 3-fold repetitions
-        return 1-(sd->nbNodes & 2);
+        return 1-(sd.getNodes() & 2);
         //return SCORE_DRAW;
     }
 
     if (ply >= MAX_PLY) [[unlikely]] {
-        return evaluate<Me>(pos); // TODO: check if we are in check ?
+        return evaluate<Me>(pos, sd.evalCache); // TODO: check if we are in check ?
     }
 
     bool inCheck = pos.inCheck();
     Score eval = SCORE_NONE;
 
     // Query Transposition Table
-    auto&&[ttHit, tte] = tt.get(pos.hash());
-    bool ttPv = PvNode || (ttHit && tte->isPv());
+    auto&&[ttHit, tte, ttSlot] = sd.tt.get(pos.hash());
+    bool ttPv = PvNode || (ttHit && tte.isPv());
     int ttDepth = inCheck ? 1 : 0; // If we are in check use depth=1 because when we are in check we go through all moves
-    Score ttScore = tte->score(ply);
+    Score ttScore = tte.score(ply);
 
     // Transposition Table cutoff
-    if (!PvNode && ttHit && tte->depth() >= ttDepth && tte->canCutoff(ttScore, beta)) {
+    if (!PvNode && ttHit && tte.depth() >= ttDepth && tte.canCutoff(ttScore, beta)) {
         return ttScore;
     }
 
     // Standing Pat
     if (!inCheck) {
         if (ttHit) {
-            eval = (tte->eval() != SCORE_NONE ? tte->eval() : evaluate<Me>(pos));
+            eval = (tte.eval() != SCORE_NONE ? tte.eval() : evaluate<Me>(pos, sd.evalCache));
 
             // Use score instead of eval if available. 
-            if (tte->canCutoff(ttScore, beta)) {
-                eval = tte->score(ply);
+            if (tte.canCutoff(ttScore, beta)) {
+                eval = tte.score(ply);
             }
         } else {
-            eval = evaluate<Me>(pos);
-            tt.set(tte, pos.hash(), ttDepth, ply, BOUND_NONE, MOVE_NONE, eval, SCORE_NONE, ttPv);
+            eval = evaluate<Me>(pos, sd.evalCache);
+            sd.tt.set(ttSlot, pos.hash(), ttDepth, ply, BOUND_NONE, MOVE_NONE, eval, SCORE_NONE, ttPv);
         }
 
         if (eval >= beta) {
@@ -430,10 +811,10 @@ Score Engine::qSearch(Score alpha, Score beta, int depth, int ply) {
     }
 
     int nbMoves = 0;
-    Move ttMove = tte->move();
+    Move ttMove = tte.move();
     // If ttMove is quiet we don't want to use it past a certain depth to allow qSearch to stabilize
     bool useTTMove = ttHit && isValidMove(ttMove) && (depth >= -7 || pos.inCheck() || pos.isTactical(ttMove));
-    MovePicker<QUIESCENCE, Me> mp(pos, useTTMove ? ttMove : MOVE_NONE);
+    MovePicker<QUIESCENCE, Me> mp(pos, sd.stack[ply].moves, useTTMove ? ttMove : MOVE_NONE, &sd.tt);
 
     mp.enumerate([&](Move move, /*unused*/bool& skipQuiets) -> bool {
         nbMoves++;
@@ -442,12 +823,12 @@ Score Engine::qSearch(Score alpha, Score beta, int depth, int ply) {
         if (!pos.see(move, 0)) return true; // continue;
 
         // Prefetch TT
-        tt.prefetch(pos.getHashAfter(move));
+        sd.tt.prefetch(pos.getHashAfter(move));
         
-        sd->nbNodes++;
+        sd.incNodes();
 
         pos.doMove<Me>(move);
-        Score score = -qSearch<~Me, NT>(-beta, -alpha, depth-1, ply+1);
+        Score score = -qSearch<~Me, NT>(sd, -beta, -alpha, depth-1, ply+1);
         pos.undoMove<Me>(move);
 
         if (searchAborted()) return false; // break
@@ -470,7 +851,7 @@ Score Engine::qSearch(Score alpha, Score beta, int depth, int ply) {
 
     // Update Transposition Table
     Bound ttBound = bestScore >= beta ? BOUND_LOWER : BOUND_UPPER;
-    tt.set(tte, pos.hash(), ttDepth, ply, ttBound, bestMove, eval, bestScore, ttPv);
+    sd.tt.set(ttSlot, pos.hash(), ttDepth, ply, ttBound, bestMove, eval, bestScore, ttPv);
 
     return bestScore;
 }
@@ -2,12 +2,20 @@
 #define ENGINE_H_INCLUDED
 
 #include <memory>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "chess.h"
 #include "position.h"
 #include "evaluate.h"
 #include "movegen.h"
 #include "movehistory.h"
+#include "movepicker.h"
 #include "tt.h"
+#include "timeman.h"
 #include "utils.h"
 
 namespace Belette {
@@ -20,58 +28,135 @@ struct SearchLimits {
     size_t maxNodes = 0;
     TimeMs maxTime = 0;
     MoveList searchMoves;
+    bool ponder = false;
+    bool infinite = false;
 };
 
+// Legal move of the root position, and the line it starts (MultiPV)
+struct RootMove {
+    explicit RootMove(Move move_): move(move_) { pv.push_back(move_); }
+
+    inline bool operator==(Move m) const { return move == m; }
+
+    // Search order: best score first, then the moves that took the most effort to refute
+    inline bool operator<(const RootMove &other) const { 
+        return score != other.score ? score > other.score : nodes > other.nodes; 
+    }
+
+    Move move;
+    Score score = -SCORE_INFINITE;         // -SCORE_INFINITE when the move failed low in the current iteration
+    Score previousScore = -SCORE_INFINITE; // Score of the previous iteration, center of the aspiration window
+    int selDepth = 0;
+    size_t nodes = 0; // Spent on this move in the current iteration
+    MoveList pv;
+};
+
+// Per ply state of a search thread, so a node can look at its ancestors. Preallocated so the search frames don't hold move lists
+struct SearchStack {
+    Score staticEval = SCORE_NONE; // SCORE_NONE when in check
+    bool inCheck = false;
+    Move killers[2] = {MOVE_NONE, MOVE_NONE};
+
+    Move pv[MAX_PLY + 1]; // Row of the triangular PV table, the PV of this ply is pv[ply .. pvLength[
+    int pvLength = 0;
+    ScoredMoveList moves; // Move picker buffer
+
+    // Per search state, the buffers are left as they are
+    inline void reset() {
+        staticEval = SCORE_NONE;
+        inCheck = false;
+        killers[0] = killers[1] = MOVE_NONE;
+        pvLength = 0;
+    }
+
+    inline void updateKillers(Move m) {
+        if (killers[0] != m) {
+            killers[1] = killers[0];
+            killers[0] = m;
+        }
+    }
+};
+
+// Allocated once per worker when the pool starts, so the per ply buffers are not rebuilt by each "go"
 struct SearchData {
-    SearchData(const Position& pos_, const SearchLimits& limits_)
-    : position(pos_), limits(limits_), nbNodes(0) {
+    SearchData(TranspositionTable &tt_, MoveHistory &moveHistory_, EvalCache &evalCache_, int threadId_ = 0)
+    : tt(tt_), moveHistory(moveHistory_), evalCache(evalCache_), threadId(threadId_), nbNodes(0) { }
+
+    // New search of the position: everything but the buffers and the tables is reset
+    inline void init(const Position &pos_, const SearchLimits &limits_) {
+        position = pos_;
+        position.setEvalWeights(evalWeights()); // A new EvalFile applies from the next search, even without a new position
+        limits = limits_;
+
+        nbNodes.store(0, std::memory_order_relaxed);
+        selDepth = 0;
+        for (SearchStack &ss : stack) ss.reset();
+
+        rootMoves.clear();
+        initRootMoves();
+        multiPV = 1;
+        pvIdx = 0;
+
+        bestPv.clear();
+        bestScore = -SCORE_INFINITE;
+        completedDepth = 0;
+
         start();
     }
 
-    void initAllocatedTime();
-
     inline TimeMs getElapsed() { return now() - startTime; }
-    inline void start() {
-        startTime = now();
-        initAllocatedTime();
-    }
+    inline void start() { startTime = now(); }
     
-    inline bool useTournamentTime() { return !!(limits.timeLeft[WHITE] | limits.timeLeft[WHITE]); }
+    inline bool useTournamentTime() { return !!(limits.timeLeft[WHITE] | limits.timeLeft[BLACK]); }
     inline bool useFixedTime() { return limits.maxTime > 0; }
-    inline bool useTimeLimit() { return useTournamentTime() || useTimeLimit(); }
+    inline bool useTimeLimit() { return useTournamentTime() || useFixedTime(); }
     inline bool useNodeCountLimit() { return limits.maxNodes > 0; }
 
-    inline bool shouldStop() {
-        // Check time every 1024 nodes for performance reason
-        if (nbNodes % 1024 != 0)  return false;
-        
-        TimeMs elapsed = now() - startTime;
+    inline bool isMainThread() const { return threadId == 0; }
 
-        if (useTournamentTime() && elapsed >= allocatedTime)
-            return true;
-        if (useFixedTime() && (elapsed > limits.maxTime))
-            return true;
-        if (useNodeCountLimit() && nbNodes >= limits.maxNodes)
+    // Legal moves, restricted to UCI searchmoves if any of them is legal. Done once, the root node iterates this list
+    inline void initRootMoves() {
+        enumerateLegalMoves(position, [&](Move move) {
+            if (limits.searchMoves.empty() || limits.searchMoves.contains(move)) rootMoves.emplace_back(move);
             return true;
-        
-        return false;
+        });
+
+        if (rootMoves.empty() && !limits.searchMoves.empty()) {
+            enumerateLegalMoves(position, [&](Move move) { rootMoves.emplace_back(move); return true; });
+        }
     }
 
+    // Only the owning thread writes the counter, other threads just read it (info, limits)
+    inline size_t getNodes() const { return nbNodes.load(std::memory_order_relaxed); }
+    inline void incNodes() { nbNodes.store(getNodes() + 1, std::memory_order_relaxed); }
+
     Position position;
     SearchLimits limits;
-    size_t nbNodes;
-    int selDepth;
+    TranspositionTable &tt;
+    MoveHistory &moveHistory; // Owned by the engine, kept between the searches of a game
+    EvalCache &evalCache; // Owned by the engine, kept between searches
+    int threadId;
+    std::atomic<size_t> nbNodes;
+    int selDepth = 0;
 
-    TimeMs startTime;
-    TimeMs lastCheck;
-    TimeMs allocatedTime;
+    SearchStack stack[MAX_PLY + 1];
 
-    MoveHistory moveHistory;
+    // Sorted after each root search, so the first multiPV ones are the lines of the last iteration
+    std::vector<RootMove> rootMoves;
+    size_t multiPV = 1;
+    size_t pvIdx = 0; // Line being searched
+
+    // Result of the last completed iteration
+    MoveList bestPv;
+    Score bestScore = -SCORE_INFINITE;
+    int completedDepth = 0;
+
+    TimeMs startTime = 0;
 };
 
 struct SearchEvent {
-    SearchEvent(int depth_, int selDepth_, const MoveList &pv_, Score bestScore_, size_t nbNode_, TimeMs elapsed_, size_t hashfull_): 
-        depth(depth_), selDepth(selDepth_), pv(pv_), bestScore(bestScore_), nbNodes(nbNode_), elapsed(elapsed_), hashfull(hashfull_) { }
+    SearchEvent(int depth_, int selDepth_, const MoveList &pv_, Score bestScore_, size_t nbNode_, TimeMs elapsed_, size_t hashfull_, int multiPv_ = 1): 
+        depth(depth_), selDepth(selDepth_), pv(pv_), bestScore(bestScore_), nbNodes(nbNode_), elapsed(elapsed_), hashfull(hashfull_), multiPv(multiPv_) { }
 
     int depth;
     int selDepth;
@@ -80,6 +165,7 @@ struct SearchEvent {
     size_t nbNodes;
     TimeMs elapsed;
     size_t hashfull;
+    int multiPv; // Line number, from 1
 };
 
 enum class NodeType {
@@ -92,19 +178,34 @@ class Engine {
 public:
     static void init();
     
-    Engine() = default;
-    virtual ~Engine() = default;
+    Engine(); // With its own transposition table
+    explicit Engine(std::shared_ptr<TranspositionTable> tt_); // Share a transposition table with other engines
+    virtual ~Engine();
 
     inline Position &position() { return rootPosition; }
     inline const Position &position() const { return rootPosition; }
 
     void search(const SearchLimits &limits);
+    void ponderHit();
     void stop();
     void waitForSearchFinish();
-    inline bool isSearching() { return searching; }
-    inline bool searchAborted() { return aborted; }
-    inline void setHashSize(size_t size) { tt.resize(size); }
-    inline void newGame() { tt.clear(); }
+    inline bool isSearching() { return searching.load(std::memory_order_acquire); }
+    inline bool searchAborted() { return aborted.load(std::memory_order_relaxed); }
+    inline TimeMs stopDeadline() const { return reachedDeadline.load(std::memory_order_relaxed); }
+    inline void setHashSize(size_t size) { tt->resize(size); }
+    inline void setSharedHash(bool enabled) { tt->setSharedName(enabled ? TT_SHARED_NAME : ""); }
+    void setNbThreads(int n);
+    inline void setMoveOverhead(TimeMs overhead) { moveOverhead = overhead; }
+    inline void setMultiPV(int n) { multiPV = std::max(1, n); }
+    inline int getNbThreads() const { return threads.size(); }
+    inline void clearHash() { tt->clear(getNbThreads()); } // Does not block, the table is zeroed in the background
+    void newGame();
+    inline bool saveHash(const std::string &path) { return !isSearching() && tt->save(path); }
+    inline bool loadHash(const std::string &path) { return !isSearching() && tt->load(path); }
+    inline std::shared_ptr<TranspositionTable> transpositionTable() const { return tt; }
+    // Of all the threads since they were started, not during a search
+    EvalTableStats pawnTableStats() const;
+    EvalTableStats materialTableStats() const;
 
 protected:
     virtual void onSearchProgress(const SearchEvent &event) = 0;
@@ -113,17 +214,63 @@ protected:
 private:
     static int LMRTable[MAX_PLY][MAX_MOVE];
 
-    std::unique_ptr<SearchData> sd;
+    // One SearchData per thread, index 0 is the main thread. Created with the thread pool
+    std::vector<std::unique_ptr<SearchData>> threadsData;
+    std::shared_ptr<TranspositionTable> tt;
+    std::vector<std::unique_ptr<MoveHistory>> moveHistories; // One per thread
+    std::vector<std::unique_ptr<EvalCache>> evalCaches; // One per thread
     Position rootPosition;
-    bool aborted = true;
-    bool searching = false;
+    std::atomic<bool> aborted = true;
+    std::atomic<bool> searching = false;
+    std::atomic<bool> pondering = false;
+    std::condition_variable ponderCondition; // Best move is held back until "ponderhit" or "stop"
+
+    TimeManager timeManager; // Only used by the main thread
+    TimeMs moveOverhead = DEFAULT_MOVE_OVERHEAD;
+    int multiPV = 1;
+    std::atomic<TimeMs> clockStart; // When our clock started: start of the search, or "ponderhit"
+
+    // Thread pool, workers are parked on startCondition between searches
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable startCondition;
+    std::condition_variable helpersCondition;
+    std::condition_variable finishCondition;
+    uint64_t searchId = 0;
+    int nbHelpersRunning = 0;
+    bool exiting = false;
+
+    // Timer thread, raises the stop flags when the deadlines of the current search are reached so the search
+    // itself never reads the clock. At the soft deadline the current iteration is finished, at the hard one it is aborted.
+    // With tournament time, they are the scaled optimum and the maximum time of the time manager
+    std::thread timerThread;
+    std::mutex timerMutex;
+    std::condition_variable timerCondition;
+    TimeMs softDeadline = 0; // 0 when not armed
+    TimeMs hardDeadline = 0;
+    bool timerExiting = false;
+    std::atomic<bool> softStop = false;
+    std::atomic<TimeMs> reachedDeadline = 0; // Hard deadline which stopped the last search, to report the stop latency
+
+    void startThreads(int n);
+    void stopThreads();
+    void threadLoop(int threadId, uint64_t lastSearchId);
+
+    void timerLoop();
+    void setTimer(TimeMs soft, TimeMs hard);
+    void armTimer();
+
+    size_t getNodes() const;
+    bool shouldStop(SearchData &sd);
+    SearchData &pickBestThread();
 
-    inline void idSearch() { rootPosition.getSideToMove() == WHITE ? idSearch<WHITE>() : idSearch<BLACK>(); }
-    template<Side Me> void idSearch();
+    void mainSearch();
+    inline void idSearch(SearchData &sd) { sd.position.getSideToMove() == WHITE ? idSearch<WHITE>(sd) : idSearch<BLACK>(sd); }
+    template<Side Me> void idSearch(SearchData &sd);
 
-    template<Side Me, NodeType NT> Score pvSearch(Score alpha, Score beta, int depth, int ply, MoveList &pv, bool cutNode);
+    template<Side Me, NodeType NT> Score pvSearch(SearchData &sd, Score alpha, Score beta, int depth, int ply, bool cutNode);
 
-    template<Side Me, NodeType NT> Score qSearch(Score alpha, Score beta, int depth, int ply);
+    template<Side Me, NodeType NT> Score qSearch(SearchData &sd, Score alpha, Score beta, int depth, int ply);
 };
 
 } /* namespace Belette */
@@ -0,0 +1,57 @@
+#ifndef EVALTABLE_H_INCLUDED
+#define EVALTABLE_H_INCLUDED
+
+#include <vector>
+#include <bit>
+#include <cstdint>
+#include <cstddef>
+
+namespace Belette {
+
+struct EvalTableStats {
+    uint64_t probes = 0;
+    uint64_t hits = 0;
+
+    inline EvalTableStats &operator+=(const EvalTableStats &other) { probes += other.probes; hits += other.hits; return *this; }
+    inline double hitRate() const { return probes ? double(hits) / probes : 0.0; }
+};
+
+// Cache of evaluation terms by key (pawn structure, material), one per search thread so it needs no synchronization.
+// Kept between searches. Entry must have a uint64_t key, ~0 is never a valid key
+template<typename Entry, size_t Size>
+class EvalTable {
+    static_assert(std::has_single_bit(Size));
+
+public:
+    EvalTable(): entries(Size) { }
+
+    // Entry for the key, hit is false when the caller must fill it
+    inline Entry &probe(uint64_t key, uint64_t weightsChecksum, bool &hit) {
+        // Entries depend on the evaluation weights, a new EvalFile invalidates everything
+        if (weightsChecksum != checksum) {
+            entries.assign(Size, Entry{});
+            for (auto &e : entries) e.key = ~0ull;
+            checksum = weightsChecksum;
+        }
+
+        // Keys are not always random (material), mix them
+        Entry &entry = entries[(key * 0x9E3779B97F4A7C15ull) >> (64 - std::countr_zero(Size))];
+        hit = entry.key == key;
+
+        stats.probes++;
+        stats.hits += hit;
+
+        return entry;
+    }
+
+    inline const EvalTableStats &getStats() const { return stats; }
+
+private:
+    std::vector<Entry> entries;
+    uint64_t checksum = 0;
+    EvalTableStats stats;
+};
+
+} /* namespace Belette */
+
+#endif /* EVALTABLE_H_INCLUDED */
@@ -1,71 +1,176 @@
+#include <atomic>
+#include <fstream>
+#include <filesystem>
 #include "evaluate.h"
+#include "nnue.h"
+#include "bitboard.h"
+#include "memory.h"
 
 namespace Belette {
 
-template<Side Me, Phase P>
-Score evaluateMaterial(const Position &pos) {
-    static_assert(P == MG || P == EG);
-    constexpr Side Opp = ~Me;
-    Score score = 0;
+static std::shared_ptr<const EvalWeights> embeddedWeights() {
+    return std::shared_ptr<const EvalWeights>(&DEFAULT_EVAL_WEIGHTS, [](const EvalWeights *) {});
+}
 
-    score += PieceValue<P>(PAWN)*pos.nbPieces(Me, PAWN) - PieceValue<P>(PAWN)*pos.nbPieces(Opp, PAWN);
-    score += PieceValue<P>(KNIGHT)*pos.nbPieces(Me, KNIGHT) - PieceValue<P>(KNIGHT)*pos.nbPieces(Opp, KNIGHT);
-    score += PieceValue<P>(BISHOP)*pos.nbPieces(Me, BISHOP) - PieceValue<P>(BISHOP)*pos.nbPieces(Opp, BISHOP);
-    score += PieceValue<P>(ROOK)*pos.nbPieces(Me, ROOK) - PieceValue<P>(ROOK)*pos.nbPieces(Opp, ROOK);
-    score += PieceValue<P>(QUEEN)*pos.nbPieces(Me, QUEEN) - PieceValue<P>(QUEEN)*pos.nbPieces(Opp, QUEEN);
+// Swapped by loadEvalWeights, a mapped file lives until the last position using it is gone
+static std::atomic<std::shared_ptr<const EvalWeights>> currentWeights = embeddedWeights();
 
-    return score;
+std::shared_ptr<const EvalWeights> evalWeights() {
+    return currentWeights.load();
 }
 
-template<Side Me, Phase P>
-Score evaluatePSQT(const Position &pos) {
-    static_assert(P == MG || P == EG);
-    constexpr Side Opp = ~Me;
-    Score score = 0;
-
-    Bitboard myPieces = pos.getPiecesBB(Me);
-    bitscan_loop(myPieces) {
-        Square sq = bitscan(myPieces);
-        PieceType pt = pieceType(pos.getPieceAt(sq));
-        score += PSQT[pt][P][relativeSquare(Me, sq)];
+bool loadEvalWeights(const std::string &path) {
+    if (path == EVAL_FILE_EMBEDDED) {
+        currentWeights.store(embeddedWeights());
+        return true;
     }
 
-    Bitboard oppPieces = pos.getPiecesBB(Opp);
-    bitscan_loop(oppPieces) {
-        Square sq = bitscan(oppPieces);
-        PieceType pt = pieceType(pos.getPieceAt(sq));
-        score -= PSQT[pt][P][relativeSquare(Opp, sq)];
+    std::error_code error;
+    if (std::filesystem::file_size(path, error) != sizeof(EvalWeights) || error) return false;
+
+    auto memory = std::make_shared<LargeMemory>();
+    if (!memory->map(path, 0, sizeof(EvalWeights), alignof(EvalWeights))) return false;
+
+    auto weights = static_cast<const EvalWeights *>(memory->data());
+    if (!weights->isValid()) return false;
+
+    currentWeights.store(std::shared_ptr<const EvalWeights>(memory, weights));
+
+    return true;
+}
+
+bool saveEvalWeights(const std::string &path) {
+    auto weights = evalWeights();
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+
+    file.write(reinterpret_cast<const char *>(weights.get()), sizeof(EvalWeights));
+
+    return bool(file);
+}
+
+template<Side Me>
+static ScorePair evaluatePawns(const Position &pos, PawnEntry &entry) {
+    constexpr Side Opp = ~Me;
+    const EvalWeights &weights = pos.evalWeights();
+    const Bitboard myPawns = pos.getPiecesBB(Me, PAWN);
+    const Bitboard oppPawns = pos.getPiecesBB(Opp, PAWN);
+
+    // Pawns behind another one of the same side, so a doubled file counts once
+    Bitboard doubled = myPawns & frontSpan<Opp>(myPawns);
+    Bitboard isolated = myPawns & ~adjacentFiles(myPawns);
+
+    // No opposing pawn can stop or capture it on its way, and not behind one of ours
+    Bitboard oppSpans = frontSpan<Opp>(oppPawns);
+    Bitboard passed = myPawns & ~(oppSpans | shift<LEFT>(oppSpans) | shift<RIGHT>(oppSpans)) & ~doubled;
+
+    // Cannot advance safely and no pawn of ours can come to defend it
+    Bitboard stops = Me == WHITE ? shift<UP>(myPawns) : shift<DOWN>(myPawns);
+    Bitboard supportable = forwardFill<Me>(pawnAttacks<Me>(myPawns));
+    Bitboard backwardStops = stops & pawnAttacks<Opp>(oppPawns) & ~supportable;
+    Bitboard backward = (Me == WHITE ? shift<DOWN>(backwardStops) : shift<UP>(backwardStops)) & ~isolated;
+
+    entry.passed |= passed;
+    entry.isolated |= isolated;
+    entry.doubled |= doubled;
+    entry.backward |= backward;
+
+    ScorePair score = SCORE_PAIR_ZERO;
+    bitscan_loop(passed) {
+        Square sq = bitscan(passed);
+        score += weights.passed[rankOf(relativeSquare(Me, sq))];
     }
+    score += weights.isolated * popcount(isolated);
+    score += weights.doubled * popcount(doubled);
+    score += weights.backward * popcount(backward);
 
     return score;
 }
 
-template<Side Me, Phase P>
-Score evaluate(const Position &pos) {
-    Score score = 0;
-    score += evaluateMaterial<Me, P>(pos);
-    score += evaluatePSQT<Me, P>(pos);
+const PawnEntry &probePawns(const Position &pos, PawnTable &pawnTable) {
+    bool hit;
+    PawnEntry &entry = pawnTable.probe(pos.pawnKey(), pos.evalWeights().checksum, hit);
+    if (hit) return entry;
+
+    entry.key = pos.pawnKey();
+    entry.passed = entry.isolated = entry.doubled = entry.backward = EmptyBB;
+    entry.score = evaluatePawns<WHITE>(pos, entry) - evaluatePawns<BLACK>(pos, entry);
+
+    return entry;
+}
+
+template<Side Me>
+static ScorePair evaluateImbalance(const EvalWeights &weights, MaterialKey key) {
+    ScorePair score = SCORE_PAIR_ZERO;
+
+    if (materialCount(key, piece(Me, BISHOP)) >= 2) score += weights.bishopPair;
 
     return score;
 }
 
 template<Side Me>
-Score evaluate(const Position &pos) {
-    Score mg = evaluate<Me, MG>(pos);
-    Score eg = evaluate<Me, EG>(pos);
+static int nonPawnMaterial(MaterialKey key) {
+    int npm = 0;
+    for (PieceType pt : {KNIGHT, BISHOP, ROOK, QUEEN}) npm += materialCount(key, piece(Me, pt)) * PieceValue<MG>(pt);
+    return npm;
+}
+
+// Endgame scale factor when Me is ahead: without pawns, being a minor piece ahead is rarely enough
+template<Side Me>
+static int scaleFactor(MaterialKey key) {
+    constexpr Side Opp = ~Me;
+    if (materialCount(key, piece(Me, PAWN))) return SCALE_FACTOR_NORMAL;
+
+    const int myNpm = nonPawnMaterial<Me>(key), oppNpm = nonPawnMaterial<Opp>(key);
+
+    if (myNpm - oppNpm <= BishopValueMg)
+        return myNpm < RookValueMg ? SCALE_FACTOR_DRAW : oppNpm <= BishopValueMg ? 4 : 14;
+
+    // KNNxK
+    if (myNpm == 2 * KnightValueMg && materialCount(key, piece(Me, KNIGHT)) == 2 && !materialCount(key, piece(Opp, PAWN)))
+        return SCALE_FACTOR_DRAW;
+
+    return SCALE_FACTOR_NORMAL;
+}
+
+const MaterialEntry &probeMaterial(const Position &pos, MaterialTable &materialTable) {
+    const MaterialKey key = pos.materialKey();
+    bool hit;
+    MaterialEntry &entry = materialTable.probe(key, pos.evalWeights().checksum, hit);
+    if (hit) return entry;
+
+    entry.key = key;
+    entry.imbalance = evaluateImbalance<WHITE>(pos.evalWeights(), key) - evaluateImbalance<BLACK>(pos.evalWeights(), key);
+    entry.scaleFactor[WHITE] = scaleFactor<WHITE>(key);
+    entry.scaleFactor[BLACK] = scaleFactor<BLACK>(key);
+    entry.draw = isInsufficientMaterial(key);
+
+    return entry;
+}
+
+// Material and PSQT are kept up to date by the Position, the pawn structure and the material terms come from hash tables
+template<Side Me>
+Score evaluatePSQT(const Position &pos, EvalCache &cache) {
+    const EvalWeights &weights = pos.evalWeights();
+    const MaterialEntry &material = probeMaterial(pos, cache.material);
+    if (material.draw) return SCORE_DRAW;
 
-    int phase = 4 * pos.nbPieceTypes(QUEEN)
-              + 2 * pos.nbPieceTypes(ROOK)
-              + 1 * pos.nbPieceTypes(KNIGHT)
-              + 1 * pos.nbPieceTypes(BISHOP);
+    ScorePair psq = pos.psq() + probePawns(pos, cache.pawns).score + material.imbalance;
+    int phase = pos.phase();
+    int eg = egScore(psq) * material.scale(Side(egScore(psq) < 0)) / SCALE_FACTOR_NORMAL; // Branchless, the sign is unpredictable
 
-    Score score = (mg*phase +  eg*(PHASE_TOTAL - phase)) / PHASE_TOTAL;
-    score += Tempo;
+    Score score = (mgScore(psq)*phase + eg*(weights.phaseTotal - phase)) / weights.phaseTotal;
+    if constexpr (Me == BLACK) score = -score;
+    score += weights.tempo;
 
     return score;
 }
 
-template Score evaluate<WHITE>(const Position &pos);
-template Score evaluate<BLACK>(const Position &pos);
+template<Side Me>
+Score evaluate(const Position &pos, EvalCache &cache) {
+    return NNUE::isEnabled() ? NNUE::evaluate<Me>(pos, cache.accumulators) : evaluatePSQT<Me>(pos, cache);
+}
+
+template Score evaluate<WHITE>(const Position &pos, EvalCache &cache);
+template Score evaluate<BLACK>(const Position &pos, EvalCache &cache);
 
 } /* namespace Belette */
\ No newline at end of file
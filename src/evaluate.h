@@ -1,8 +1,14 @@
 #ifndef EVALUATE_H_INCLUDED
 #define EVALUATE_H_INCLUDED
 
+#include <algorithm>
+#include <bit>
+#include <memory>
+#include <string>
 #include "chess.h"
 #include "position.h"
+#include "pawns.h"
+#include "material.h"
 
 namespace Belette {
 
@@ -47,6 +53,8 @@ constexpr Score PieceValue(Piece p) { return PIECE_VALUE[p][P]; }
 
 constexpr int PHASE_TOTAL = 24;
 
+constexpr int PIECE_TYPE_PHASE[NB_PIECE_TYPE] = { 0, 0, 1, 1, 2, 4, 0 }; // PHASE_TOTAL with the starting material
+
 constexpr Score PSQT[NB_PIECE_TYPE][NB_PHASE][NB_SQUARE] = {
     {},
     // Pawn
@@ -190,13 +198,116 @@ constexpr Score PSQT[NB_PIECE_TYPE][NB_PHASE][NB_SQUARE] = {
     }
 };
 
+// Pawn structure
+constexpr Score PassedPawnMg[NB_RANK] = { 0, 2, 4, 8, 16, 30, 50, 0 };
+constexpr Score PassedPawnEg[NB_RANK] = { 0, 8, 12, 20, 35, 55, 80, 0 };
+constexpr Score IsolatedPawnMg = -5, IsolatedPawnEg = -10;
+constexpr Score DoubledPawnMg = -8, DoubledPawnEg = -18;
+constexpr Score BackwardPawnMg = -6, BackwardPawnEg = -8;
+
+// Material imbalance
+constexpr Score BishopPairMg = 25, BishopPairEg = 50;
+
+constexpr char EVAL_FILE_MAGIC[8] = {'B', 'E', 'L', 'E', 'T', 'T', 'E', 'W'};
+constexpr uint32_t EVAL_FILE_VERSION = 3; // Increase when the layout of EvalWeights changes
+constexpr const char *EVAL_FILE_EMBEDDED = "<embedded>"; // EvalFile value of the weights built in the binary
+
+// Evaluation weights, in the layout of the weight files: a file is mapped and used in place. Positions keep the weights
+// they were set up with, so a new file does not affect a running search
+struct EvalWeights {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;
+    uint64_t checksum; // Of the weights below
+
+    alignas(64) ScorePair psq[NB_PIECE][NB_SQUARE]; // Material and PSQT of a piece on a square, from white point of view
+    int32_t piecePhase[NB_PIECE];
+    int32_t phaseTotal;
+    Score tempo;
+    ScorePair passed[NB_RANK]; // By relative rank
+    ScorePair isolated;
+    ScorePair doubled;
+    ScorePair backward;
+    ScorePair bishopPair;
+
+    constexpr uint64_t computeChecksum() const {
+        uint64_t hash = 0;
+        auto add = [&](int32_t w) { hash = (std::rotl(hash, 23) ^ uint32_t(w)) * 0x9E3779B97F4A7C15ull; };
+
+        for (auto &row : psq) for (ScorePair sp : row) add(sp);
+        for (int32_t phase : piecePhase) add(phase);
+        add(phaseTotal);
+        add(tempo);
+        for (ScorePair sp : passed) add(sp);
+        add(isolated);
+        add(doubled);
+        add(backward);
+        add(bishopPair);
+
+        return hash;
+    }
+
+    inline bool isValid() const {
+        return std::equal(std::begin(EVAL_FILE_MAGIC), std::end(EVAL_FILE_MAGIC), magic)
+            && version == EVAL_FILE_VERSION && size == sizeof(EvalWeights) && phaseTotal > 0
+            && checksum == computeChecksum();
+    }
+};
+
+static_assert(sizeof(ScorePair) == sizeof(int32_t) && sizeof(Score) == sizeof(int32_t));
+
+// Built from the constants above, embedded in the binary with the layout of a file
+constexpr EvalWeights DEFAULT_EVAL_WEIGHTS = [] {
+    EvalWeights w {};
+
+    std::copy(std::begin(EVAL_FILE_MAGIC), std::end(EVAL_FILE_MAGIC), w.magic);
+    w.version = EVAL_FILE_VERSION;
+    w.size = sizeof(EvalWeights);
+
+    for (PieceType pt = PAWN; pt <= KING; pt = PieceType(pt + 1)) {
+        for (Square sq = SQ_FIRST; sq < NB_SQUARE; sq = Square(sq + 1)) {
+            w.psq[piece(WHITE, pt)][sq] = makeScorePair(PIECE_TYPE_VALUE[pt][MG] + PSQT[pt][MG][sq], PIECE_TYPE_VALUE[pt][EG] + PSQT[pt][EG][sq]);
+            w.psq[piece(BLACK, pt)][relativeSquare(BLACK, sq)] = -w.psq[piece(WHITE, pt)][sq];
+        }
+
+        w.piecePhase[piece(WHITE, pt)] = w.piecePhase[piece(BLACK, pt)] = PIECE_TYPE_PHASE[pt];
+    }
+
+    w.phaseTotal = PHASE_TOTAL;
+    w.tempo = Tempo;
+
+    for (int r = RANK_1; r <= RANK_8; r++) w.passed[r] = makeScorePair(PassedPawnMg[r], PassedPawnEg[r]);
+    w.isolated = makeScorePair(IsolatedPawnMg, IsolatedPawnEg);
+    w.doubled = makeScorePair(DoubledPawnMg, DoubledPawnEg);
+    w.backward = makeScorePair(BackwardPawnMg, BackwardPawnEg);
+    w.bishopPair = makeScorePair(BishopPairMg, BishopPairEg);
+
+    w.checksum = w.computeChecksum();
+
+    return w;
+}();
+
+std::shared_ptr<const EvalWeights> evalWeights(); // Weights for the next positions set up
+bool loadEvalWeights(const std::string &path); // EVAL_FILE_EMBEDDED for the default weights. Does not wait for running searches
+bool saveEvalWeights(const std::string &path); // Current weights, as a starting point to tune them
+
+// Per thread caches of the evaluation
+struct EvalCache {
+    PawnTable pawns;
+    MaterialTable material;
+    NNUE::AccumulatorStack accumulators;
+};
+
 template<Side Me>
-Score evaluate(const Position &pos);
+Score evaluate(const Position &pos, EvalCache &cache);
 
-inline Score evaluate(const Position &pos) {
-    return pos.getSideToMove() == WHITE ? evaluate<WHITE>(pos) : evaluate<BLACK>(pos);
+inline Score evaluate(const Position &pos, EvalCache &cache) {
+    return pos.getSideToMove() == WHITE ? evaluate<WHITE>(pos, cache) : evaluate<BLACK>(pos, cache);
 };
 
+const PawnEntry &probePawns(const Position &pos, PawnTable &pawnTable);
+const MaterialEntry &probeMaterial(const Position &pos, MaterialTable &materialTable);
+
 } /* namespace Belette */
 
 #endif /* EVALUATE_H_INCLUDED */
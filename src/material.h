@@ -0,0 +1,47 @@
+#ifndef MATERIAL_H_INCLUDED
+#define MATERIAL_H_INCLUDED
+
+#include <cstdint>
+#include "chess.h"
+#include "evaltable.h"
+
+namespace Belette {
+
+// Material signature: the number of each piece (kings excepted) in a 4 bits field, at bit 4 * piece. Exact, two positions
+// with the same material have the same key
+using MaterialKey = uint64_t;
+
+constexpr MaterialKey materialKeyUnit(Piece p) {
+    return p == NO_PIECE || pieceType(p) == KING ? 0 : MaterialKey(1) << (4 * p);
+}
+
+constexpr int materialCount(MaterialKey key, Piece p) {
+    return (key >> (4 * p)) & 15;
+}
+
+// Kings alone, or with a single minor piece: no mate is possible
+constexpr bool isInsufficientMaterial(MaterialKey key) {
+    return key == 0
+        || key == materialKeyUnit(W_KNIGHT) || key == materialKeyUnit(W_BISHOP)
+        || key == materialKeyUnit(B_KNIGHT) || key == materialKeyUnit(B_BISHOP);
+}
+
+constexpr size_t MATERIAL_TABLE_SIZE = 512; // Entries, power of 2
+
+constexpr int SCALE_FACTOR_NORMAL = 64;
+constexpr int SCALE_FACTOR_DRAW = 0;
+
+struct MaterialEntry {
+    uint64_t key;
+    ScorePair imbalance; // White point of view
+    uint8_t scaleFactor[NB_SIDE]; // Of the endgame score when the side is ahead, out of SCALE_FACTOR_NORMAL
+    bool draw; // Insufficient material for both sides
+
+    inline int scale(Side strongSide) const { return scaleFactor[strongSide]; }
+};
+
+using MaterialTable = EvalTable<MaterialEntry, MATERIAL_TABLE_SIZE>;
+
+} /* namespace Belette */
+
+#endif /* MATERIAL_H_INCLUDED */
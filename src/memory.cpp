@@ -0,0 +1,247 @@
+#include <cstdlib>
+#include <fstream>
+#include <thread>
+#include <chrono>
+#include "memory.h"
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#elif defined(_WIN32)
+#include <malloc.h>
+#endif
+
+namespace Belette {
+
+bool LargeMemory::allocate(size_t size, size_t alignment) {
+    release();
+
+    if (size == 0) return true;
+
+#if defined(__linux__)
+    if (size >= HUGE_PAGE_SIZE) {
+        size_t hugeSize = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+        // Explicit huge pages only work if the admin reserved some (vm.nr_hugepages), fallback silently otherwise
+        void *mem = mmap(nullptr, hugeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            ptr = mem;
+            allocatedSize = hugeSize;
+            kind = HUGE_PAGES;
+            return true;
+        }
+
+        alignment = HUGE_PAGE_SIZE;
+    }
+#endif
+
+    // aligned_alloc requires a size multiple of the alignment
+    size_t alignedSize = (size + alignment - 1) / alignment * alignment;
+
+#if defined(_WIN32)
+    void *mem = _aligned_malloc(alignedSize, alignment);
+#else
+    void *mem = std::aligned_alloc(alignment, alignedSize);
+#endif
+
+    if (mem == nullptr) return false;
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (alignedSize >= HUGE_PAGE_SIZE)
+        madvise(mem, alignedSize, MADV_HUGEPAGE);
+#endif
+
+    ptr = mem;
+    allocatedSize = alignedSize;
+    kind = ALIGNED;
+
+    return true;
+}
+
+// Map a part of a file. On linux pages are only read from disk when they are first accessed,
+// elsewhere the file is read at once. offset must be a multiple of the page size
+bool LargeMemory::map(const std::string &path, size_t offset, size_t size, size_t alignment) {
+    release();
+
+    if (size == 0) return true;
+
+#if defined(__linux__)
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+    close(fd); // The mapping keeps its own reference to the file
+
+    if (mem == MAP_FAILED) return false;
+
+    // Accesses are random, reading ahead would only load pages nobody needs
+    madvise(mem, size, MADV_RANDOM);
+
+    ptr = mem;
+    allocatedSize = size;
+    kind = FILE_MAPPING;
+
+    return true;
+#else
+    std::ifstream file(path, std::ios::binary);
+    if (!file || !allocate(size, alignment)) return false;
+
+    if (!file.seekg(offset) || !file.read(static_cast<char *>(ptr), size)) {
+        release();
+        return false;
+    }
+
+    return true;
+#endif
+}
+
+#if defined(__linux__)
+// Locks on the bytes of the shared memory object (open file description locks, released when the process dies):
+// the decision lock serializes the attach and unlink decisions, every mapping holds a read lock on the liveness byte
+constexpr off_t SHARED_DECISION_LOCK = 0;
+constexpr off_t SHARED_LIVENESS_LOCK = 1;
+
+static bool lockShared(int fd, off_t byte, short type, bool wait) {
+    struct flock fl = {};
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = byte;
+    fl.l_len = 1;
+
+    int r;
+    while ((r = fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl)) != 0 && errno == EINTR) { }
+    return r == 0;
+}
+#endif
+
+// Map a named shared memory segment, it is created with the given size and zero filled if it does not exist yet.
+// Otherwise the existing segment is mapped with its own size. The last mapping to be released removes the segment,
+// mappings of crashed processes do not count. Only supported on linux
+bool LargeMemory::mapShared(const std::string &name, size_t size, bool &created) {
+    release();
+
+#if defined(__linux__)
+    int fd = -1;
+    created = false;
+
+    // The segment found may be unlinked by its last user before we hold the decision lock, then try again
+    for (int attempt = 0; attempt < 100 && fd < 0; attempt++) {
+        fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        created = fd >= 0;
+        if (!created) fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0) continue;
+
+        struct stat st;
+        if (!lockShared(fd, SHARED_DECISION_LOCK, F_WRLCK, true) || fstat(fd, &st) != 0) {
+            close(fd);
+            return false;
+        }
+
+        if (st.st_nlink == 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd < 0) return false;
+
+    // Closing the descriptor releases the locks
+    auto fail = [&] {
+        if (created) shm_unlink(name.c_str());
+        close(fd);
+        return false;
+    };
+
+    if (created) {
+        if (ftruncate(fd, size) != 0) return fail();
+    } else {
+        // Sized by its creator under the decision lock
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) return fail();
+
+        size = st.st_size;
+    }
+
+    void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) return fail();
+
+    if (!lockShared(fd, SHARED_LIVENESS_LOCK, F_RDLCK, true)) {
+        munmap(mem, size);
+        return fail();
+    }
+
+    lockShared(fd, SHARED_DECISION_LOCK, F_UNLCK, false);
+
+#if defined(MADV_HUGEPAGE)
+    if (size >= HUGE_PAGE_SIZE)
+        madvise(mem, size, MADV_HUGEPAGE);
+#endif
+
+    ptr = mem;
+    allocatedSize = size;
+    kind = SHARED;
+    sharedFd = fd;
+    sharedName = name;
+
+    return true;
+#else
+    created = false;
+    return false;
+#endif
+}
+
+bool LargeMemory::isSharedWithOthers() const {
+#if defined(__linux__)
+    if (kind != SHARED) return false;
+
+    // Our own read lock does not conflict, any other one does
+    struct flock fl = {};
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = SHARED_LIVENESS_LOCK;
+    fl.l_len = 1;
+
+    return fcntl(sharedFd, F_OFD_GETLK, &fl) != 0 || fl.l_type != F_UNLCK;
+#else
+    return false;
+#endif
+}
+
+void LargeMemory::release() {
+    switch (kind) {
+#if defined(__linux__)
+        case HUGE_PAGES:
+        case FILE_MAPPING:
+            munmap(ptr, allocatedSize);
+            break;
+        case SHARED:
+            // No new mapping can start while we decide, a process attaching next creates a new segment
+            lockShared(sharedFd, SHARED_DECISION_LOCK, F_WRLCK, true);
+            if (!isSharedWithOthers()) shm_unlink(sharedName.c_str());
+
+            munmap(ptr, allocatedSize);
+            close(sharedFd);
+            sharedFd = -1;
+            sharedName.clear();
+            break;
+#endif
+        case ALIGNED:
+#if defined(_WIN32)
+            _aligned_free(ptr);
+#else
+            std::free(ptr);
+#endif
+            break;
+        default:
+            break;
+    }
+
+    ptr = nullptr;
+    allocatedSize = 0;
+    kind = NONE;
+}
+
+} /* namespace Belette */
@@ -0,0 +1,51 @@
+#ifndef MEMORY_H_INCLUDED
+#define MEMORY_H_INCLUDED
+
+#include <cstddef>
+#include <string>
+
+namespace Belette {
+
+constexpr size_t HUGE_PAGE_SIZE = 2*1024*1024;
+
+// Memory block for big tables. Backed by 2MB pages when the OS allows it, otherwise by regular aligned memory
+class LargeMemory {
+public:
+    LargeMemory() = default;
+    LargeMemory(const LargeMemory &) = delete;
+    LargeMemory &operator=(const LargeMemory &) = delete;
+    ~LargeMemory() { release(); }
+
+    bool allocate(size_t size, size_t alignment);
+    bool map(const std::string &path, size_t offset, size_t size, size_t alignment);
+    bool mapShared(const std::string &name, size_t size, bool &created);
+    void release();
+
+    bool isSharedWithOthers() const; // Another live mapping of the shared segment exists
+
+    inline void *data() const { return ptr; }
+    inline size_t size() const { return allocatedSize; }
+    inline bool empty() const { return ptr == nullptr; }
+    inline bool usesHugePages() const { return kind == HUGE_PAGES; }
+
+private:
+    enum Kind {
+        NONE,
+        HUGE_PAGES, // Explicit huge pages (mmap MAP_HUGETLB)
+        ALIGNED,    // Aligned heap memory, transparent huge pages requested with madvise on linux
+        FILE_MAPPING, // Private mapping of a file (mmap MAP_PRIVATE), modifications are never written back
+        SHARED        // POSIX shared memory object, mapped by several processes
+    };
+
+    void *ptr = nullptr;
+    size_t allocatedSize = 0;
+    Kind kind = NONE;
+
+    // Shared segment, kept open for its locks
+    int sharedFd = -1;
+    std::string sharedName;
+};
+
+} /* namespace Belette */
+
+#endif /* MEMORY_H_INCLUDED */
@@ -12,19 +12,19 @@ using MoveScore = int32_t;
 
 using PartialMoveList = fixed_vector<Move, 32, uint8_t>;
 
+constexpr MoveScore HISTORY_AGING = 128; // Factor kept at each new search, /256
+
 class MoveHistory {
 public:
-    MoveHistory(): counterMoves{MOVE_NONE}, killerMoves{MOVE_NONE}, history{0} { }
+    MoveHistory(): counterMoves{MOVE_NONE}, history{0} { }
 
-    inline void clearKillers(int ply) {
-        assert(ply >= 0 && ply < MAX_PLY);
-        killerMoves[ply][0] = killerMoves[ply][1] = MOVE_NONE;
-    }
+    inline void clear() { *this = MoveHistory(); }
 
-    template<int K> inline Move getKiller(int ply) const {
-        assert(ply >= 0 && ply < MAX_PLY);
-        static_assert(K == 0 || K == 1);
-        return killerMoves[ply][K];
+    // Called before each search of a game: the previous searches still help ordering, with less weight
+    inline void age() {
+        for (auto &h : history) {
+            for (auto &entry : h) entry = entry * HISTORY_AGING / 256;
+        }
     }
 
     inline Move getCounter(const Position& pos) const {
@@ -40,9 +40,8 @@ public:
     }
 
     template<Side Me>
-    inline void update(const Position& pos, Move bestMove, int ply, int depth, const PartialMoveList& quietMoves) {
+    inline void update(const Position& pos, Move bestMove, int depth, const PartialMoveList& quietMoves) {
         if (!pos.isTactical(bestMove)) {
-            updateKiller(bestMove, ply);
             updateCounter(pos, bestMove);
 
             MoveScore bonus = historyBonus(depth);
@@ -55,22 +54,12 @@ public:
     }
 private:
     Move counterMoves[NB_PIECE][NB_SQUARE];
-    Move killerMoves[MAX_PLY][2];
     MoveScore history[NB_SIDE][NB_SQUARE*NB_SQUARE];
 
     inline MoveScore historyBonus(int depth) {
         return std::min(1536, 8*depth*depth);
     }
 
-    inline void updateKiller(Move move, int ply) {
-        assert(ply >= 0 && ply < MAX_PLY);
-
-        if (killerMoves[ply][0] != move) {
-            killerMoves[ply][1] = killerMoves[ply][0];
-            killerMoves[ply][0] = move;
-        }
-    }
-
     inline void updateCounter(const Position& pos, Move move) {
         Move prevMove = pos.previousMove();
         if (isValidMove(prevMove))
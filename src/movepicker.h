@@ -38,13 +38,14 @@ enum MovePickerType {
 template<MovePickerType Type, Side Me>
 class MovePicker {
 public:
-    MovePicker(const Position &pos_, Move ttMove_ = MOVE_NONE)
-    : pos(pos_), ttMove(ttMove_), moveHistory(nullptr), refutations{MOVE_NONE}
+    // Moves are generated & scored in the given buffer, the search gives it a preallocated one per ply so its frames stay small
+    MovePicker(const Position &pos_, ScoredMoveList &moves_, Move ttMove_ = MOVE_NONE, const TranspositionTable *tt_ = nullptr)
+    : pos(pos_), moves(moves_), ttMove(ttMove_), tt(tt_), moveHistory(nullptr), refutations{MOVE_NONE}
     { }
 
-    MovePicker(const Position &pos_, Move ttMove_, const MoveHistory* moveHistory_, int ply_)
-    : pos(pos_), ttMove(ttMove_), moveHistory(moveHistory_), ply(ply_),
-      refutations{moveHistory->getKiller<0>(ply), moveHistory->getKiller<1>(ply), moveHistory->getCounter(pos)}
+    MovePicker(const Position &pos_, ScoredMoveList &moves_, Move ttMove_, const MoveHistory* moveHistory_, const Move *killers, const TranspositionTable *tt_)
+    : pos(pos_), moves(moves_), ttMove(ttMove_), tt(tt_), moveHistory(moveHistory_),
+      refutations{killers[0], killers[1], moveHistory->getCounter(pos)}
     {
         assert(refutations[0] != refutations[1] || refutations[0] == MOVE_NONE);
     }
@@ -54,12 +55,15 @@ public:
 
 private:
     const Position &pos;
+    ScoredMoveList &moves;
     Move ttMove;
+    const TranspositionTable *tt; // Optional, only used for prefetching
 
     const MoveHistory *moveHistory;
-    int ply;
     Move refutations[3];
 
+    inline void prefetch(uint64_t hash) const { if (tt != nullptr) tt->prefetch(hash); }
+
     inline MoveScore scoreEvasion(Move m);
     inline MoveScore scoreTactical(Move m);
     inline MoveScore scoreQuiet(Move m);
@@ -71,13 +75,15 @@ template<typename Handler>
 bool MovePicker<Type, Me>::enumerate(const Handler &handler) {
     bool skipQuiets = false;
 
-    tt.prefetch(pos.getHashAfter(ttMove));
+    if (isValidMove(ttMove))
+        prefetch(pos.getHashAfter(ttMove));
+
     // TT Move
     if (pos.isLegal<Me>(ttMove)) {
         CALL_HANDLER(ttMove, skipQuiets);
     }
     
-    ScoredMoveList moves;
+    moves.clear();
     ScoredMove *current, *endBadTacticals, *beginQuiets, *endBadQuiets;
 
     // Evasions
@@ -85,7 +91,7 @@ bool MovePicker<Type, Me>::enumerate(const Handler &handler) {
         enumerateLegalMoves<Me, ALL_MOVES>(pos, [&](Move m) {
             if (m == ttMove) return true; // continue;
 
-            tt.prefetch(pos.getHashAfter(m));
+            prefetch(pos.getHashAfter(m));
 
             moves.emplace_back(m, scoreEvasion(m));
             return true;
@@ -107,7 +113,7 @@ bool MovePicker<Type, Me>::enumerate(const Handler &handler) {
     enumerateLegalMoves<Me, TACTICAL_MOVES>(pos, [&](Move m) {
         if (m == ttMove) return true; // continue;
         
-        tt.prefetch(pos.getHashAfter(m));
+        prefetch(pos.getHashAfter(m));
 
         moves.emplace_back(m, scoreTactical(m));
         return true;
@@ -151,9 +157,9 @@ bool MovePicker<Type, Me>::enumerate(const Handler &handler) {
     if constexpr(Type == QUIESCENCE) return true;
 
     if (moveHistory != nullptr) [[likely]] {
-        tt.prefetch(refutations[0]);
-        tt.prefetch(refutations[1]);
-        tt.prefetch(refutations[2]);
+        prefetch(refutations[0]);
+        prefetch(refutations[1]);
+        prefetch(refutations[2]);
 
         // Killer 1
         if (refutations[0] != ttMove && !pos.isTactical(refutations[0]) && pos.isLegal<Me>(refutations[0])) {
@@ -181,7 +187,7 @@ bool MovePicker<Type, Me>::enumerate(const Handler &handler) {
         if (move == ttMove) return true; // continue;
         if (refutations[0] == move || refutations[1] == move || refutations[2] == move) return true; // continue
 
-        tt.prefetch(pos.getHashAfter(move));
+        prefetch(pos.getHashAfter(move));
 
         moves.emplace_back(move, scoreQuiet(move));
         return true;
@@ -0,0 +1,290 @@
+#include <fstream>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <immintrin.h>
+#include "nnue.h"
+#include "position.h"
+#include "bitboard.h"
+#include "memory.h"
+
+namespace Belette::NNUE {
+
+struct Network {
+    alignas(64) int16_t ftWeights[NB_FEATURES][L1_SIZE];
+    alignas(64) int16_t ftBiases[L1_SIZE];
+    alignas(64) int8_t l1Weights[L2_SIZE][2 * L1_SIZE];
+    alignas(64) int32_t l1Biases[L2_SIZE];
+    alignas(64) int8_t l2Weights[L2_SIZE];
+    int32_t l2Bias;
+};
+
+struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nbFeatures;
+    uint32_t l1Size;
+    uint32_t l2Size;
+};
+
+static std::unique_ptr<LargeMemory> networkMemory;
+static const Network *network = nullptr;
+static std::string networkPath;
+static uint32_t networkId = 0; // Changes with each loaded network, so accumulators computed with a previous one are not reused
+static std::atomic<bool> enabled = true;
+
+inline bool isComputed(const Accumulator &acc, Side perspective, uint64_t hash) {
+    return acc.networkId[perspective] == networkId && acc.hash[perspective] == hash;
+}
+
+// King bucket of the (flipped and mirrored) king square, only the a-d files are used
+constexpr int KING_BUCKETS[NB_SQUARE] = {
+    0, 0, 1, 1, 1, 1, 0, 0,
+    2, 2, 2, 2, 2, 2, 2, 2,
+    3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3,
+};
+
+// Bucket and mirroring of the feature set of a perspective, from the square of its king
+inline int kingKey(Side perspective, Square ksq) {
+    Square sq = relativeSquare(perspective, ksq);
+    bool mirror = fileOf(sq) >= FILE_E;
+    return KING_BUCKETS[mirror ? int(sq) ^ 7 : int(sq)] | (mirror << 2);
+}
+
+inline int featureIndex(Side perspective, int key, Piece p, Square sq) {
+    int s = int(relativeSquare(perspective, sq)) ^ (key & 4 ? 7 : 0);
+    int pieceIdx = 6 * (side(p) != perspective) + pieceType(p) - 1;
+
+    return ((key & 3) * 12 + pieceIdx) * NB_SQUARE + s;
+}
+
+inline bool needsRefresh(const DirtyPieces &dirty, Side perspective) {
+    for (int i = 0; i < dirty.nb; i++) {
+        const DirtyPiece &d = dirty.pieces[i];
+        if (d.piece == piece(perspective, KING) && kingKey(perspective, d.from) != kingKey(perspective, d.to))
+            return true;
+    }
+
+    return false;
+}
+
+// out = in + sum of the added rows - sum of the removed rows
+inline void updateValues(const int16_t *in, int16_t *out, const int *added, int nbAdded, const int *removed, int nbRemoved) {
+#if defined(__AVX2__)
+    constexpr int ChunkSize = 16;
+
+    for (int c = 0; c < L1_SIZE; c += ChunkSize) {
+        __m256i v = _mm256_load_si256(reinterpret_cast<const __m256i*>(in + c));
+
+        for (int i = 0; i < nbAdded; i++)
+            v = _mm256_add_epi16(v, _mm256_load_si256(reinterpret_cast<const __m256i*>(&network->ftWeights[added[i]][c])));
+        for (int i = 0; i < nbRemoved; i++)
+            v = _mm256_sub_epi16(v, _mm256_load_si256(reinterpret_cast<const __m256i*>(&network->ftWeights[removed[i]][c])));
+
+        _mm256_store_si256(reinterpret_cast<__m256i*>(out + c), v);
+    }
+#else
+    for (int c = 0; c < L1_SIZE; c++) {
+        int16_t v = in[c];
+
+        for (int i = 0; i < nbAdded; i++) v += network->ftWeights[added[i]][c];
+        for (int i = 0; i < nbRemoved; i++) v -= network->ftWeights[removed[i]][c];
+
+        out[c] = v;
+    }
+#endif
+}
+
+inline void refresh(const Position &pos, Accumulator &acc, Side perspective, int key) {
+    int added[NB_SQUARE];
+    int nbAdded = 0;
+
+    Bitboard pieces = pos.getPiecesBB();
+    bitscan_loop(pieces) {
+        Square sq = bitscan(pieces);
+        added[nbAdded++] = featureIndex(perspective, key, pos.getPieceAt(sq), sq);
+    }
+
+    updateValues(network->ftBiases, acc.values[perspective], added, nbAdded, nullptr, 0);
+    acc.hash[perspective] = pos.hash();
+    acc.networkId[perspective] = networkId;
+}
+
+inline void update(const Accumulator &prev, Accumulator &acc, const State &state, Side perspective, int key) {
+    int added[3], removed[3];
+    int nbAdded = 0, nbRemoved = 0;
+
+    for (int i = 0; i < state.dirty.nb; i++) {
+        const DirtyPiece &d = state.dirty.pieces[i];
+        if (d.from != SQ_NONE) removed[nbRemoved++] = featureIndex(perspective, key, d.piece, d.from);
+        if (d.to != SQ_NONE) added[nbAdded++] = featureIndex(perspective, key, d.piece, d.to);
+    }
+
+    updateValues(prev.values[perspective], acc.values[perspective], added, nbAdded, removed, nbRemoved);
+    acc.hash[perspective] = state.hash;
+    acc.networkId[perspective] = networkId;
+}
+
+// Walks back to the last computed ply, then updates every ply up to the current one so the siblings of the current node
+// can start from them. A king move that changes the feature set in between means a refresh from the board instead.
+// An entry computed for another position of the same ply (a sibling, another search) has a different hash
+void updateAccumulator(const Position &pos, AccumulatorStack &accumulators, Side perspective) {
+    const int key = kingKey(perspective, pos.getKingSquare(perspective));
+    const int start = std::max(pos.historyStart, pos.current - MAX_PLY);
+    int i = pos.current;
+
+    for (; !isComputed(accumulators.at(i), perspective, pos.historyAt(i).hash); i--) {
+        if (i == start || needsRefresh(pos.historyAt(i).dirty, perspective)) {
+            refresh(pos, accumulators.at(pos.current), perspective, key);
+            return;
+        }
+    }
+
+    for (i++; i <= pos.current; i++) {
+        update(accumulators.at(i - 1), accumulators.at(i), pos.historyAt(i), perspective, key);
+    }
+}
+
+// Clipped ReLU of the accumulator, as bytes for the next layer
+inline void activate(const int16_t *in, uint8_t *out) {
+#if defined(__AVX2__)
+    const __m256i max = _mm256_set1_epi16(QA);
+
+    for (int i = 0; i < L1_SIZE; i += 32) {
+        __m256i a = _mm256_min_epi16(_mm256_load_si256(reinterpret_cast<const __m256i*>(in + i)), max);
+        __m256i b = _mm256_min_epi16(_mm256_load_si256(reinterpret_cast<const __m256i*>(in + i + 16)), max);
+
+        // packus saturates negative values to 0, and interleaves the 128 bits lanes of a and b
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0b11011000);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(out + i), packed);
+    }
+#else
+    for (int i = 0; i < L1_SIZE; i++) out[i] = std::clamp<int>(in[i], 0, QA);
+#endif
+}
+
+// Hidden layer before its activation: biases + weights . input
+inline void affine(const uint8_t *input, int32_t *output) {
+#if defined(__AVX2__)
+    const __m256i ones = _mm256_set1_epi16(1);
+
+    // 4 neurons at a time, so each input chunk is loaded once for them
+    for (int n = 0; n < L2_SIZE; n += 4) {
+        __m256i sum[4] = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+
+        for (int i = 0; i < 2 * L1_SIZE; i += 32) {
+            __m256i x = _mm256_load_si256(reinterpret_cast<const __m256i*>(input + i));
+
+            for (int k = 0; k < 4; k++) {
+                __m256i w = _mm256_load_si256(reinterpret_cast<const __m256i*>(&network->l1Weights[n + k][i]));
+
+                // u8 x i8 pairs summed in i16 (at most 2*127*128, no saturation), then in i32
+                sum[k] = _mm256_add_epi32(sum[k], _mm256_madd_epi16(_mm256_maddubs_epi16(x, w), ones));
+            }
+        }
+
+        // Horizontal sums of the 4 registers, neuron k ends up in the lane k of both 128 bits halves
+        __m256i s = _mm256_hadd_epi32(_mm256_hadd_epi32(sum[0], sum[1]), _mm256_hadd_epi32(sum[2], sum[3]));
+        __m128i s128 = _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+        s128 = _mm_add_epi32(s128, _mm_load_si128(reinterpret_cast<const __m128i*>(&network->l1Biases[n])));
+
+        _mm_store_si128(reinterpret_cast<__m128i*>(output + n), s128);
+    }
+#else
+    for (int n = 0; n < L2_SIZE; n++) {
+        int32_t sum = network->l1Biases[n];
+        for (int i = 0; i < 2 * L1_SIZE; i++) sum += int32_t(input[i]) * network->l1Weights[n][i];
+
+        output[n] = sum;
+    }
+#endif
+}
+
+template<Side Me>
+Score evaluate(const Position &pos, AccumulatorStack &accumulators) {
+    const Accumulator &acc = accumulators.at(pos.historySize());
+    if (!isComputed(acc, WHITE, pos.hash())) updateAccumulator(pos, accumulators, WHITE);
+    if (!isComputed(acc, BLACK, pos.hash())) updateAccumulator(pos, accumulators, BLACK);
+
+    // Side to move first
+    alignas(32) uint8_t input[2 * L1_SIZE];
+    activate(acc.values[Me], input);
+    activate(acc.values[~Me], input + L1_SIZE);
+
+    alignas(16) int32_t hidden[L2_SIZE];
+    affine(input, hidden);
+
+    int32_t output = network->l2Bias;
+    for (int i = 0; i < L2_SIZE; i++) {
+        output += std::clamp(hidden[i] >> L1_SHIFT, 0, QA) * network->l2Weights[i];
+    }
+
+    Score score = int64_t(output) * EVAL_SCALE / (QA * QB);
+
+    return std::clamp(score, -SCORE_MATE_MAX_PLY + 1, SCORE_MATE_MAX_PLY - 1);
+}
+
+template Score evaluate<WHITE>(const Position &pos, AccumulatorStack &accumulators);
+template Score evaluate<BLACK>(const Position &pos, AccumulatorStack &accumulators);
+
+// Header, then the raw little endian arrays in the order of Network
+bool load(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return false;
+
+    FileHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+
+    if (header.magic != FILE_MAGIC || header.version != FILE_VERSION
+     || header.nbFeatures != NB_FEATURES || header.l1Size != L1_SIZE || header.l2Size != L2_SIZE)
+        return false;
+
+    auto memory = std::make_unique<LargeMemory>();
+    if (!memory->allocate(sizeof(Network), 64)) return false;
+
+    Network *net = static_cast<Network*>(memory->data());
+    file.read(reinterpret_cast<char*>(net->ftWeights), sizeof(net->ftWeights));
+    file.read(reinterpret_cast<char*>(net->ftBiases), sizeof(net->ftBiases));
+    file.read(reinterpret_cast<char*>(net->l1Weights), sizeof(net->l1Weights));
+    file.read(reinterpret_cast<char*>(net->l1Biases), sizeof(net->l1Biases));
+    file.read(reinterpret_cast<char*>(net->l2Weights), sizeof(net->l2Weights));
+    file.read(reinterpret_cast<char*>(&net->l2Bias), sizeof(net->l2Bias));
+
+    if (!file || file.peek() != std::ifstream::traits_type::eof()) return false;
+
+    network = net;
+    networkMemory = std::move(memory);
+    networkPath = path;
+    networkId++;
+
+    return true;
+}
+
+void unload() {
+    network = nullptr;
+    networkMemory.reset();
+    networkPath.clear();
+}
+
+bool isLoaded() {
+    return network != nullptr;
+}
+
+const std::string &loadedFile() {
+    return networkPath;
+}
+
+void setEnabled(bool e) {
+    enabled.store(e, std::memory_order_relaxed);
+}
+
+bool isEnabled() {
+    return network != nullptr && enabled.load(std::memory_order_relaxed);
+}
+
+} /* namespace Belette::NNUE */
@@ -0,0 +1,80 @@
+#ifndef NNUE_H_INCLUDED
+#define NNUE_H_INCLUDED
+
+#include <cstdint>
+#include <string>
+#include "chess.h"
+
+namespace Belette {
+
+class Position;
+
+namespace NNUE {
+
+// (768 x NB_KING_BUCKETS -> L1_SIZE) x 2 -> L2_SIZE -> 1
+// Inputs are the pieces seen from each side: own/opponent, type and square, flipped for black and mirrored when the king
+// is on the e-h files. Each perspective has its own king bucket, a king move that changes it refreshes that accumulator
+constexpr int NB_KING_BUCKETS = 4;
+constexpr int NB_FEATURES = NB_KING_BUCKETS * 2 * 6 * NB_SQUARE;
+constexpr int L1_SIZE = 256;
+constexpr int L2_SIZE = 16;
+
+// Quantization: activations are in [0, QA], the weights of the two last layers are scaled by QB
+constexpr int QA = 127;
+constexpr int QB = 64;
+constexpr int L1_SHIFT = 6; // QA * QB >> L1_SHIFT = QA
+constexpr int EVAL_SCALE = 400; // Centipawns for an output of 1.0
+
+constexpr const char *DEFAULT_FILE = "belette.nnue"; // Loaded at startup if present
+constexpr uint32_t FILE_MAGIC = 0x4e4e4c42; // "BLNN"
+constexpr uint32_t FILE_VERSION = 1;
+
+// Piece moved, added (from == SQ_NONE) or removed (to == SQ_NONE) by a move
+struct DirtyPiece {
+    Piece piece;
+    Square from;
+    Square to;
+};
+
+// Pieces changed by the move of a State
+struct DirtyPieces {
+    DirtyPiece pieces[3];
+    int nb;
+
+    inline void reset() { nb = 0; }
+    inline void add(Piece p, Square from, Square to) { pieces[nb++] = {p, from, to}; }
+};
+
+// First layer output of both perspectives, each tagged with the position and the network it was computed for
+struct alignas(32) Accumulator {
+    int16_t values[NB_SIDE][L1_SIZE];
+    uint64_t hash[NB_SIDE];
+    uint32_t networkId[NB_SIDE] = {}; // 0 when not computed
+};
+
+// Per thread accumulators of the last MAX_PLY + 1 plies, indexed by the ply of the position so a search uses consecutive
+// entries. Computed lazily from the previous ply and the dirty pieces of the move
+struct AccumulatorStack {
+    Accumulator entries[MAX_PLY + 1];
+
+    inline Accumulator &at(size_t ply) { return entries[ply % (MAX_PLY + 1)]; }
+};
+
+bool load(const std::string &path); // Must not be called during a search
+void unload(); // Back to the PSQT evaluation
+bool isLoaded();
+const std::string &loadedFile(); // Empty when no network is loaded
+void setEnabled(bool enabled);
+bool isEnabled(); // Loaded and enabled
+
+// Brings the accumulator of the current ply up to date, from the last computed ply or from scratch
+void updateAccumulator(const Position &pos, AccumulatorStack &accumulators, Side perspective);
+
+template<Side Me>
+Score evaluate(const Position &pos, AccumulatorStack &accumulators);
+
+} /* namespace NNUE */
+
+} /* namespace Belette */
+
+#endif /* NNUE_H_INCLUDED */
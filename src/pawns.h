@@ -0,0 +1,26 @@
+#ifndef PAWNS_H_INCLUDED
+#define PAWNS_H_INCLUDED
+
+#include <cstdint>
+#include "chess.h"
+#include "evaltable.h"
+
+namespace Belette {
+
+constexpr size_t PAWN_TABLE_SIZE = 16*1024; // Entries, power of 2
+
+// Pawn structure of a pawn key. Bitboards hold the pawns of both sides, intersect with the pawns of a side to split them
+struct PawnEntry {
+    uint64_t key;
+    Bitboard passed;
+    Bitboard isolated;
+    Bitboard doubled;
+    Bitboard backward;
+    ScorePair score; // White point of view
+};
+
+using PawnTable = EvalTable<PawnEntry, PAWN_TABLE_SIZE>;
+
+} /* namespace Belette */
+
+#endif /* PAWNS_H_INCLUDED */
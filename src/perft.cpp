@@ -13,10 +13,10 @@ namespace Belette {
 template<bool Div, Side Me>
 size_t perftmp(Position &pos, int depth) {
     size_t total = 0;
-    MoveList moves;
+    ScoredMoveList moves;
     
     if (!Div && depth <= 1) {
-        MovePicker<MAIN, Me> mp(pos);
+        MovePicker<MAIN, Me> mp(pos, moves);
         mp.enumerate([&](Move m, bool& skipQuiets) {
             total += 1;
             return true;
@@ -25,7 +25,7 @@ size_t perftmp(Position &pos, int depth) {
         return total;
     }
     
-    MovePicker<MAIN, Me> mp(pos);
+    MovePicker<MAIN, Me> mp(pos, moves);
     mp.enumerate([&](Move move, bool& skipQuiets) {
         size_t n = 0;
 
@@ -1,6 +1,8 @@
 #include <sstream>
 #include <cstring>
+#include <algorithm>
 #include "position.h"
+#include "evaluate.h"
 #include "uci.h"
 #include "zobrist.h"
 
@@ -21,25 +23,46 @@ Position::Position() {
 }
 
 Position::Position(const Position &other) {
-    std::memcpy(this, &other, sizeof(Position));
-    this->state = this->history + (other.state - other.history);
+    *this = other;
 }
 
+// The board and only the states the repetition detection can reach: back to the last irreversible move, plus the 2 first
+// states it always skips (see isRepetitionDraw). Searches start from a copy, the whole history would be ~35KB
 Position& Position::operator=(const Position &other) {
-    std::memcpy(this, &other, sizeof(Position));
-    this->state = this->history + (other.state - other.history);
+    if (this == &other) return *this;
+
+    std::memcpy(pieces, other.pieces, sizeof(pieces));
+    std::memcpy(sideBB, other.sideBB, sizeof(sideBB));
+    std::memcpy(piecesBB, other.piecesBB, sizeof(piecesBB));
+    sideToMove = other.sideToMove;
+    weights = other.weights;
+
+    current = other.current;
+    int first = std::max({0, current - other.state->fiftyMoveRule - 2, current - MAX_HISTORY + 1});
+
+    historyStart = first;
+    for (int i = first; i <= current; i++) historyAt(i) = other.historyAt(i);
+    state = &historyAt(current);
 
     return *this;
 }
 
 void Position::reset() {
+    current = 0;
+    historyStart = 0;
     state = &history[0];
+    state->dirty.reset();
 
     state->fiftyMoveRule = 0;
     state->halfMoves = 0;
     state->epSquare = SQ_NONE;
     state->castlingRights = NO_CASTLING;
     state->move = MOVE_NONE;
+    state->pawnKey = 0;
+    state->materialKey = 0;
+    state->psq = SCORE_PAIR_ZERO;
+    state->phase = 0;
+    weights = Belette::evalWeights();
     for(int i=0; i<NB_PIECE_TYPE; i++) state->threatsFor[i] = EmptyBB;
 
     for(int i=0; i<NB_SQUARE; i++) pieces[i] = NO_PIECE;
@@ -84,7 +107,7 @@ std::string Position::fen() const {
     if (canCastle(WHITE_KING_SIDE)) ss << 'K';
     if (canCastle(WHITE_QUEEN_SIDE)) ss << 'Q';
     if (canCastle(BLACK_KING_SIDE)) ss << 'k';
-    if (canCastle(BLACK_KING_SIDE)) ss << 'q';
+    if (canCastle(BLACK_QUEEN_SIDE)) ss << 'q';
     if (!canCastle(ANY_CASTLING)) ss << '-';
 
     ss << (getEpSquare() == SQ_NONE ? " - " : " " + Uci::formatSquare(getEpSquare()) + " ");
@@ -175,6 +198,7 @@ bool Position::setFromFEN(const std::string &fen) {
 
     updateBitboards();
     this->state->hash = computeHash();
+    this->state->pawnKey = computePawnKey();
 
     return true;
 }
@@ -214,10 +238,8 @@ std::ostream& operator<<(std::ostream& os, const Position& pos) {
 std::string Position::debugHistory() {
     std::stringstream ss;
 
-    assert(this->state - this->history < MAX_HISTORY && this->state - this->history >= 0);
-
-    for(State *s = this->state; s > this->history; s--) {
-        ss << Uci::formatMove(s->move) << " ";
+    for (int i = current; i > std::max(0, current - MAX_HISTORY + 1); i--) {
+        ss << Uci::formatMove(historyAt(i).move) << " ";
     }
 
     return ss.str();
@@ -339,6 +361,9 @@ inline void Position::setPiece(Square sq, Piece p) {
     //typeBB[pieceType(p)] |= b;
     sideBB[Me] |= b;
     piecesBB[p] |= b;
+    state->psq += weights->psq[p][sq];
+    state->phase += weights->piecePhase[p];
+    state->materialKey += materialKeyUnit(p);
 }
 template<Side Me>
 inline void Position::unsetPiece(Square sq) {
@@ -349,6 +374,9 @@ inline void Position::unsetPiece(Square sq) {
     //typeBB[pieceType(p)] &= ~b;
     sideBB[Me] &= ~b;
     piecesBB[p] &= ~b;
+    state->psq -= weights->psq[p][sq];
+    state->phase -= weights->piecePhase[p];
+    state->materialKey -= materialKeyUnit(p);
 }
 template<Side Me>
 inline void Position::movePiece(Square from, Square to) {
@@ -361,6 +389,7 @@ inline void Position::movePiece(Square from, Square to) {
     //typeBB[pieceType(p)] ^= fromTo;
     sideBB[Me] ^= fromTo;
     piecesBB[p] ^= fromTo;
+    state->psq += weights->psq[p][to] - weights->psq[p][from];
 }
 
 template<Side Me, MoveType Mt>
@@ -378,6 +407,7 @@ void Position::doMove(Move m) {
     assert(to == getEpSquare() || Mt != EN_PASSANT);
 
     uint64_t h = state->hash;
+    uint64_t ph = state->pawnKey;
 
     // Reset epSquare (branchless)
     h ^= Zobrist::enpassantKeys[fileOf(state->epSquare) + NB_FILE*(state->epSquare == SQ_NONE)];
@@ -385,24 +415,32 @@ void Position::doMove(Move m) {
         h ^= Zobrist::enpassantKeys[fileOf(state->epSquare)];
     }*/
 
-    State *oldState = state++;
+    State *oldState = state;
+    state = &historyAt(++current);
     state->epSquare = SQ_NONE;
     state->castlingRights = oldState->castlingRights;
     state->fiftyMoveRule = oldState->fiftyMoveRule + 1;
     state->halfMoves = oldState->halfMoves + 1;
     state->capture = capture;
     state->move = m;
+    state->materialKey = oldState->materialKey;
+    state->psq = oldState->psq;
+    state->phase = oldState->phase;
+    state->dirty.reset();
 
     if constexpr (Mt == NORMAL) {
         // TODO: Try to remove branching using xor
         if (capture != NO_PIECE) {
             h ^= Zobrist::keys[capture][to];
+            if (capture == piece(~Me, PAWN)) ph ^= Zobrist::keys[capture][to];
             unsetPiece<~Me>(to);
+            state->dirty.add(capture, to, SQ_NONE);
             state->fiftyMoveRule = 0;
         }
         
         h ^= Zobrist::keys[p][from] ^ Zobrist::keys[p][to];
         movePiece<Me>(from, to);
+        state->dirty.add(p, from, to);
 
         // Update castling right (no branching)
         h ^= Zobrist::castlingKeys[state->castlingRights];
@@ -410,6 +448,7 @@ void Position::doMove(Move m) {
         h ^= Zobrist::castlingKeys[state->castlingRights];
 
         if (p == piece(Me, PAWN)) {
+            ph ^= Zobrist::keys[p][from] ^ Zobrist::keys[p][to];
             state->fiftyMoveRule = 0;
 
             // Set epSquare on double push
@@ -436,6 +475,8 @@ void Position::doMove(Move m) {
         h ^= Zobrist::keys[piece(Me, ROOK)][rookFrom] ^ Zobrist::keys[piece(Me, ROOK)][rookTo];
         movePiece<Me>(from, to);
         movePiece<Me>(rookFrom, rookTo);
+        state->dirty.add(piece(Me, KING), from, to);
+        state->dirty.add(piece(Me, ROOK), rookFrom, rookTo);
 
         // Update castling right
         h ^= Zobrist::castlingKeys[state->castlingRights];
@@ -450,11 +491,15 @@ void Position::doMove(Move m) {
         if (capture != NO_PIECE) {
             h ^= Zobrist::keys[capture][to];
             unsetPiece<~Me>(to);
+            state->dirty.add(capture, to, SQ_NONE);
         }
 
         h ^= Zobrist::keys[piece(Me, PAWN)][from] ^ Zobrist::keys[piece(Me, promotionType)][to];
+        ph ^= Zobrist::keys[piece(Me, PAWN)][from];
         unsetPiece<Me>(from);
         setPiece<Me>(to, piece(Me, promotionType));
+        state->dirty.add(piece(Me, PAWN), from, SQ_NONE);
+        state->dirty.add(piece(Me, promotionType), SQ_NONE, to);
         state->fiftyMoveRule = 0;
 
         // Update castling right
@@ -468,8 +513,12 @@ void Position::doMove(Move m) {
 
         h ^= Zobrist::keys[piece(~Me, PAWN)][epsq];
         h ^= Zobrist::keys[piece(Me, PAWN)][from] ^ Zobrist::keys[piece(Me, PAWN)][to];
+        ph ^= Zobrist::keys[piece(~Me, PAWN)][epsq];
+        ph ^= Zobrist::keys[piece(Me, PAWN)][from] ^ Zobrist::keys[piece(Me, PAWN)][to];
         unsetPiece<~Me>(epsq);
         movePiece<Me>(from, to);
+        state->dirty.add(piece(~Me, PAWN), epsq, SQ_NONE);
+        state->dirty.add(piece(Me, PAWN), from, to);
 
         state->fiftyMoveRule = 0;
     }
@@ -478,7 +527,11 @@ void Position::doMove(Move m) {
     h ^= Zobrist::sideToMoveKey;
 
     state->hash = h;
+    state->pawnKey = ph;
     assert(computeHash() == hash());
+    assert(computePawnKey() == pawnKey());
+    assert(computeMaterialKey() == materialKey());
+    assert(computePsq() == psq() && computePhase() == phase());
     
     updateBitboards<~Me>();
 }
@@ -500,7 +553,6 @@ void Position::undoMove(Move m) {
     const Square to = moveTo(m);
     const Piece capture = state->capture;
 
-    state--;
     sideToMove = Me;
 
     if constexpr (Mt == NORMAL) {
@@ -529,6 +581,9 @@ void Position::undoMove(Move m) {
         const Square epsq = to - pawnDirection(Me);
         setPiece<~Me>(epsq, piece(~Me, PAWN));
     }
+
+    // Only now, the piece updates above went to the discarded state. The previous one still holds its own psq and phase
+    state = &historyAt(--current);
 }
 
 template void Position::undoMove<WHITE, NORMAL>(Move m);
@@ -549,13 +604,19 @@ template<Side Me> void Position::doNullMove() {
     // Reset epSquare (branchless)
     h ^= Zobrist::enpassantKeys[fileOf(state->epSquare) + NB_FILE*(state->epSquare == SQ_NONE)];
 
-    State *oldState = state++;
+    State *oldState = state;
+    state = &historyAt(++current);
     state->epSquare = SQ_NONE;
     state->castlingRights = oldState->castlingRights;
     state->fiftyMoveRule = oldState->fiftyMoveRule + 1;
     state->halfMoves = oldState->halfMoves + 1;
     state->capture = NO_PIECE;
     state->move = MOVE_NULL;
+    state->pawnKey = oldState->pawnKey;
+    state->materialKey = oldState->materialKey;
+    state->psq = oldState->psq;
+    state->phase = oldState->phase;
+    state->dirty.reset(); // Same pieces
 
     sideToMove = ~Me;
     h ^= Zobrist::sideToMoveKey;
@@ -572,7 +633,7 @@ template void Position::doNullMove<WHITE>();
 template void Position::doNullMove<BLACK>();
 
 template<Side Me> void Position::undoNullMove() {
-    state--;
+    state = &historyAt(--current);
     sideToMove = Me;
 }
 
@@ -594,7 +655,8 @@ template<Side Me>
 inline void Position::updateThreatenedSquares() {
     constexpr Side Opp = ~Me;
 
-    assert(state->threatsFor[PAWN] == EmptyBB);
+    // States after the current one are not copied with the position, they may hold anything
+    state->threatsFor[PAWN] = EmptyBB;
 
     // Pawns
     Bitboard threatened = pawnAttacks<Opp>(getPiecesBB(Opp, PAWN));
@@ -685,6 +747,41 @@ inline void Position::updateCheckers() {
     );
 }
 
+ScorePair Position::computePsq() const {
+    ScorePair psq = SCORE_PAIR_ZERO;
+
+    for (Square sq=SQ_FIRST; sq<NB_SQUARE; ++sq) {
+        Piece p = getPieceAt(sq);
+        if (p == NO_PIECE) continue;
+
+        psq += weights->psq[p][sq];
+    }
+
+    return psq;
+}
+
+int Position::computePhase() const {
+    int phase = 0;
+
+    for (Square sq=SQ_FIRST; sq<NB_SQUARE; ++sq) {
+        Piece p = getPieceAt(sq);
+        if (p == NO_PIECE) continue;
+
+        phase += weights->piecePhase[p];
+    }
+
+    return phase;
+}
+
+// Only the current state is updated, the previous ones keep the sums of the former weights
+void Position::setEvalWeights(std::shared_ptr<const EvalWeights> w) {
+    if (w == weights) return;
+
+    weights = std::move(w);
+    state->psq = computePsq();
+    state->phase = computePhase();
+}
+
 uint64_t Position::computeHash() const {
     uint64_t h = 0;
 
@@ -702,6 +799,27 @@ uint64_t Position::computeHash() const {
     return h;
 }
 
+uint64_t Position::computePawnKey() const {
+    uint64_t h = 0;
+
+    Bitboard pawns = getPiecesBB(WHITE, PAWN) | getPiecesBB(BLACK, PAWN);
+    bitscan_loop(pawns) {
+        Square sq = bitscan(pawns);
+        h ^= Zobrist::keys[getPieceAt(sq)][sq];
+    }
+
+    return h;
+}
+
+MaterialKey Position::computeMaterialKey() const {
+    MaterialKey key = 0;
+
+    for (Piece p : {W_PAWN, W_KNIGHT, W_BISHOP, W_ROOK, W_QUEEN, B_PAWN, B_KNIGHT, B_BISHOP, B_ROOK, B_QUEEN})
+        key += materialKeyUnit(p) * popcount(getPiecesBB(side(p), pieceType(p)));
+
+    return key;
+}
+
 // Static exchange evaluation. Algorithm from stockfish
 bool Position::see(Move move, int threshold) const {
     assert(isValidMove(move));
@@ -3,16 +3,22 @@
 
 #include <string>
 #include <array>
+#include <algorithm>
 #include <vector>
+#include <memory>
 #include "chess.h"
 #include "bitboard.h"
 #include "zobrist.h"
+#include "nnue.h"
+#include "material.h"
 
 #define STARTPOS_FEN "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
 #define KIWIPETE_FEN "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1"
 
 namespace Belette {
 
+struct EvalWeights;
+
 struct State {
     CastlingRight castlingRights;
     Square epSquare;
@@ -23,19 +29,21 @@ struct State {
     Piece capture;
 
     uint64_t hash;
+    uint64_t pawnKey; // Zobrist keys of the pawns only, for the pawn hash table
+    MaterialKey materialKey;
+    ScorePair psq; // Material and PSQT of all the pieces, from white point of view
+    int phase;
     Bitboard threatsFor[NB_PIECE_TYPE];
     Bitboard checkers;
     Bitboard checkMask;
     Bitboard pinDiag;
     Bitboard pinOrtho;
 
-    inline State& prev() { return *(this-1); }
-    inline const State& prev() const { return *(this-1); }
-
-    inline State& next() { return *(this+1); }
-    inline const State& next() const { return *(this+1); }
+    NNUE::DirtyPieces dirty; // To update the NNUE accumulators from the previous ply
 };
 
+static_assert((MAX_HISTORY & (MAX_HISTORY - 1)) == 0 && MAX_HISTORY > 100 + 2 + MAX_PLY);
+
 class Position {
 public:
     Position();
@@ -107,12 +115,24 @@ public:
     uint64_t computeHash() const;
     inline uint64_t getHashAfter(Move m) const;
     inline uint64_t getHashAfterNullMove() const { return hash() ^ Zobrist::sideToMoveKey; };
+    inline uint64_t pawnKey() const { return state->pawnKey; }
+    uint64_t computePawnKey() const;
+    inline MaterialKey materialKey() const { return state->materialKey; }
+    MaterialKey computeMaterialKey() const;
+
+    inline const EvalWeights &evalWeights() const { return *weights; }
+    void setEvalWeights(std::shared_ptr<const EvalWeights> w);
+
+    inline ScorePair psq() const { return state->psq; }
+    inline int phase() const { return state->phase; }
+    ScorePair computePsq() const;
+    int computePhase() const;
 
     inline Bitboard checkMask() const { return state->checkMask; }
     inline Bitboard pinDiag() const { return state->pinDiag; }
     inline Bitboard pinOrtho() const { return state->pinOrtho; }
 
-    inline size_t historySize() const { return state - history; }
+    inline size_t historySize() const { return current; }
 
     // Check if a position occurs 3 times in the game history
     inline bool isRepetitionDraw() const;
@@ -133,6 +153,8 @@ public:
     std::string debugHistory();
 
 private:
+    friend void NNUE::updateAccumulator(const Position &pos, NNUE::AccumulatorStack &accumulators, Side perspective);
+
     void setCastlingRights(CastlingRight cr);
 
     template<Side Me, MoveType Mt> void doMove(Move m);
@@ -157,9 +179,17 @@ private:
     Bitboard piecesBB[NB_PIECE];
 
     Side sideToMove;
+    std::shared_ptr<const EvalWeights> weights; // Of the psq and phase of the states
 
+    // Only the last MAX_HISTORY states are kept, older ones are overwritten. It is enough for the repetition detection
+    // which never looks further than the fifty move rule, and searches never go back further than their root
     State *state;
+    int current; // Number of moves since setFromFEN, index of state in the ring
+    int historyStart; // Oldest state that belongs to this position, the ones before may hold anything
     State history[MAX_HISTORY];
+
+    inline State &historyAt(int i) { return history[i & (MAX_HISTORY - 1)]; }
+    inline const State &historyAt(int i) const { return history[i & (MAX_HISTORY - 1)]; }
 };
 
 std::ostream& operator<<(std::ostream& os, const Position& pos);
@@ -175,25 +205,8 @@ inline Bitboard Position::getAttackers(Square sq, Bitboard occupied) const {
 }
 
 inline bool Position::isMaterialDraw() const {
-    if ((getPiecesTypeBB(PAWN) | getPiecesTypeBB(ROOK) | getPiecesTypeBB(QUEEN)) != 0)
-        return false;
-
-    // Not accurate for KBxKB which should be insufficient materiel if bishops are opposite colors, 
-    // but it's too expensive to compute ^^
-    if (popcount(getPiecesBB(WHITE)) > 1 && popcount(getPiecesBB(BLACK)) > 1)
-        return false;
-
-    // Not accurate for KBBxK where the bishops are same color, which is extremly rare
-    if (popcount(getPiecesTypeBB(KNIGHT) | getPiecesTypeBB(BISHOP)) > 1)
-        return false;
-
-    if (!getPiecesTypeBB(BISHOP))
-        return false;
-
-    if (popcount(getPiecesTypeBB(KNIGHT)) < 3)
-        return false;
-
-    return true;
+    // KBxKB with opposite colored bishops is left to the evaluation, like KBBxK with same colored bishops
+    return isInsufficientMaterial(materialKey());
 }
 
 // Check if a position occurs 3 times in the game history
@@ -202,15 +215,10 @@ inline bool Position::isRepetitionDraw() const {
         return false;
 
     int reps = 0;
-    //State *start = std::max(history + 2, state - getFiftyMoveRule());
-    const State *historyStart = history+2;
-    const State *fiftyMoveStart = state - getFiftyMoveRule();
-    const State *start = fiftyMoveStart > historyStart ? fiftyMoveStart : historyStart;
-
-    for (State *st = state - 2; st >= start; st -= 2) {
-        assert(st >= history && st <= state);
+    int start = std::max({2, current - getFiftyMoveRule(), current - MAX_HISTORY + 1});
 
-        if (st->hash == state->hash && ++reps == 2) {
+    for (int i = current - 2; i >= start; i -= 2) {
+        if (historyAt(i).hash == state->hash && ++reps == 2) {
             return true;
         }
     }
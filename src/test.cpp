@@ -2,10 +2,24 @@
 #include <vector>
 #include <string>
 #include <iostream>
+#include <thread>
+#include <atomic>
+#include <fstream>
+#include <cstdio>
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include "test.h"
 #include "uci.h"
 #include "position.h"
 #include "perft.h"
+#include "tt.h"
+#include "nnue.h"
+#include "movegen.h"
+#include "engine.h"
 
 namespace Belette::Test {
 
@@ -28,6 +42,18 @@ std::vector<TestCase> ALL_TESTS = {
     {"3k4/8/8/2KpP2r/8/8/8/8 w - - 0 2", 6, 1441479}                                        // En passant
 };
 
+void printResult(int nbFailed) {
+    if (nbFailed > 0) {    
+        console << "##############################" << std::endl;
+        console << "/!\\ Some tests failed :( /!\\" << std::endl;
+        console << "##############################" << std::endl;
+    } else {
+        console << "----------------------------------------" << std::endl;
+        console << " Congratulations! All tests succeeded ! " << std::endl;
+        console << "----------------------------------------" << std::endl;
+    }
+}
+
 void run() {
     Position pos;
     int i = 1, nbTest = ALL_TESTS.size(), nbSuccess = 0, nbFailed = 0;
@@ -51,16 +77,335 @@ void run() {
 
     console << std::endl << std::endl;
 
-    if (nbFailed > 0) {    
-        console << "##############################" << std::endl;
-        console << "/!\\ Some tests failed :( /!\\" << std::endl;
-        console << "##############################" << std::endl;
+    printResult(nbFailed);
+}
+
+// Content stored for a given hash in the TT stress test
+struct TTStressData {
+    Move move;
+    Score score;
+    int depth;
+
+    TTStressData(uint64_t h) {
+        Square from = Square(h & 63);
+        Square to = Square((from + 1 + (h >> 6) % 63) & 63); // from != to, so never MOVE_NONE nor MOVE_NULL
+        move = makeMove(from, to);
+        score = int((h >> 16) % 20001) - 10000;
+        depth = int((h >> 32) % 64);
+    }
+};
+
+// Hammer a small transposition table from many threads. Every position always stores the same content (derived from its hash)
+// so any hit returning something else is a torn or corrupted entry
+void runTT() {
+    constexpr size_t TableSize = 64*1024;
+    constexpr size_t NbKeys = 16*1024;
+    constexpr size_t NbIterations = 2*1024*1024;
+    const int nbThreads = std::max(4, (int)std::thread::hardware_concurrency());
+
+    TranspositionTable tt(TableSize);
+    tt.clear(nbThreads);
+    tt.waitForBackgroundTask();
+    tt.newSearch();
+
+    std::vector<uint64_t> keys(NbKeys);
+    uint64_t seed = 0x9E3779B97F4A7C15ull;
+    for (auto &k : keys) {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17; // xorshift
+        k = seed;
+    }
+
+    std::atomic<size_t> nbHits = 0, nbCorrupted = 0;
+    std::vector<std::thread> threads;
+
+    console << "[Test TT] " << nbThreads << " threads, " << NbIterations << " probes per thread" << std::endl;
+
+    for (int t = 0; t < nbThreads; t++) {
+        threads.emplace_back([&, t] {
+            size_t hits = 0, corrupted = 0;
+
+            for (size_t i = 0; i < NbIterations; i++) {
+                uint64_t hash = keys[(i * 7919 + t * 104729) % NbKeys];
+                TTStressData expected(hash);
+
+                auto&&[ttHit, tte, ttSlot] = tt.get(hash);
+
+                if (ttHit) {
+                    hits++;
+                    corrupted += tte.move() != expected.move || tte.score(0) != expected.score || tte.depth() != expected.depth;
+                }
+
+                tt.set(ttSlot, hash, expected.depth, 0, BOUND_EXACT, expected.move, SCORE_NONE, expected.score, false);
+            }
+
+            nbHits += hits;
+            nbCorrupted += corrupted;
+        });
+    }
+
+    for (auto &th : threads) th.join();
+
+    if (nbCorrupted == 0) {
+        console << "  SUCCESS - " << nbHits << " hits, no corrupted entry" << std::endl;
     } else {
-        console << "----------------------------------------" << std::endl;
-        console << " Congratulations! All tests succeeded ! " << std::endl;
-        console << "----------------------------------------" << std::endl;
+        console << "  FAILED! - " << nbCorrupted << " corrupted entries on " << nbHits << " hits" << std::endl;
+    }
+
+    // After a clear, entries of the previous generation must be ignored even before the memory is zeroed
+    tt.clear(nbThreads);
+    tt.newSearch();
+
+    size_t nbStale = 0;
+    for (uint64_t hash : keys) {
+        auto&&[ttHit, tte, ttSlot] = tt.get(hash);
+        nbStale += ttHit;
+    }
+
+    tt.waitForBackgroundTask();
+
+    if (nbStale == 0) {
+        console << "  SUCCESS - no stale entry after clear" << std::endl;
+    } else {
+        console << "  FAILED! - " << nbStale << " stale entries after clear" << std::endl;
     }
-    
+
+    size_t nbSharedErrors = 0;
+
+#if defined(__linux__)
+    // Two tables attached to the same shared memory segment, like two processes would be. Few keys, so no bucket overflows
+    {
+        TranspositionTable a(TableSize), b(TableSize * 2);
+        a.setSharedName("/belette-hash-test");
+        b.setSharedName("/belette-hash-test");
+
+        a.clear();
+        a.newSearch();
+
+        for (size_t i = 0; i < 256; i++) {
+            TTStressData expected(keys[i]);
+            auto&&[ttHit, tte, ttSlot] = a.get(keys[i]);
+            a.set(ttSlot, keys[i], expected.depth, 0, BOUND_EXACT, expected.move, SCORE_NONE, expected.score, false);
+        }
+
+        b.clear(); // Must not wipe the entries of a
+        b.newSearch();
+
+        nbSharedErrors += !a.isShared() || !b.isShared() || b.size() != a.size();
+
+        for (size_t i = 0; i < 256; i++) {
+            TTStressData expected(keys[i]);
+            auto&&[ttHit, tte, ttSlot] = b.get(keys[i]);
+            nbSharedErrors += !ttHit || tte.move() != expected.move || tte.score(0) != expected.score;
+        }
+    }
+
+    // A process that dies without detaching must not count as a user: the next one clears the table and removes the segment
+    {
+        const std::string name = "/belette-hash-crash";
+        pid_t pid = fork();
+
+        if (pid == 0) {
+            TranspositionTable crashed(TableSize);
+            crashed.setSharedName(name);
+            crashed.clear();
+            crashed.newSearch();
+
+            for (size_t i = 0; i < 256; i++) {
+                TTStressData expected(keys[i]);
+                auto&&[ttHit, tte, ttSlot] = crashed.get(keys[i]);
+                crashed.set(ttSlot, keys[i], expected.depth, 0, BOUND_EXACT, expected.move, SCORE_NONE, expected.score, false);
+            }
+
+            _exit(crashed.isShared() ? 0 : 1); // No destructor, like a crash
+        }
+
+        int status = 1;
+        nbSharedErrors += pid < 0 || waitpid(pid, &status, 0) != pid || status != 0;
+
+        {
+            TranspositionTable survivor(TableSize);
+            survivor.setSharedName(name);
+            survivor.clear(); // Alone, so the entries of the dead process are dropped
+            survivor.newSearch();
+
+            nbSharedErrors += !survivor.isShared();
+
+            for (size_t i = 0; i < 256; i++) {
+                auto&&[ttHit, tte, ttSlot] = survivor.get(keys[i]);
+                nbSharedErrors += ttHit;
+            }
+        }
+
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        nbSharedErrors += fd >= 0;
+        if (fd >= 0) {
+            close(fd);
+            shm_unlink(name.c_str());
+        }
+    }
+
+    if (nbSharedErrors == 0) {
+        console << "  SUCCESS - shared table" << std::endl;
+    } else {
+        console << "  FAILED! - " << nbSharedErrors << " errors with a shared table" << std::endl;
+    }
+#endif
+
+    console << std::endl << std::endl;
+
+    printResult(nbCorrupted + nbStale + nbSharedErrors);
+}
+
+// Counts the search events, and checks every reported best move is legal
+class TestEngine : public Engine {
+public:
+    std::atomic<int> nbProgress = 0;
+    std::atomic<int> nbFinish = 0;
+    std::atomic<int> nbIllegal = 0;
+
+private:
+    virtual void onSearchProgress(const SearchEvent &event) { nbProgress++; }
+    virtual void onSearchFinish(const SearchEvent &event) {
+        nbFinish++;
+        nbIllegal += event.pv.empty() || !position().isLegal(event.pv[0]);
+    }
+};
+
+void runThreads() {
+    TestEngine engine;
+    SearchLimits limits;
+    limits.maxDepth = 5;
+    int nbErrors = 0;
+
+    console << "[Test Threads] Threads changed between searches" << std::endl;
+
+    engine.position().setFromFEN(STARTPOS_FEN);
+
+    for (int nbThreads : {1, 4, 2, 1, 3}) {
+        engine.setNbThreads(nbThreads);
+
+        // New workers must wait for the next search, not run the previous one again
+        int nbProgress = engine.nbProgress;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        nbErrors += engine.nbProgress != nbProgress;
+
+        engine.search(limits);
+        engine.waitForSearchFinish();
+    }
+
+    nbErrors += engine.nbFinish != 5;
+    nbErrors += engine.nbIllegal;
+
+    if (nbErrors == 0) {
+        console << "  SUCCESS - " << engine.nbFinish << " searches" << std::endl;
+    } else {
+        console << "  FAILED! - " << nbErrors << " errors, " << engine.nbFinish << " searches finished" << std::endl;
+    }
+
+    console << std::endl << std::endl;
+
+    printResult(nbErrors);
+}
+
+// Network with random weights, in the NNUE file format
+bool writeRandomNetwork(const std::string &path) {
+    using namespace NNUE;
+
+    std::ofstream file(path, std::ios::binary);
+    uint64_t seed = 0x2545F4914F6CDD1Dull;
+    auto random = [&](int range) {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17; // xorshift
+        return int(seed % (2 * range + 1)) - range;
+    };
+    auto write = [&](auto value, size_t count, int range) {
+        for (size_t i = 0; i < count; i++) {
+            value = decltype(value)(random(range));
+            file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+    };
+
+    uint32_t header[] = { FILE_MAGIC, FILE_VERSION, NB_FEATURES, L1_SIZE, L2_SIZE };
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+    write(int16_t(0), size_t(NB_FEATURES) * L1_SIZE, 32); // Feature transformer
+    write(int16_t(0), L1_SIZE, 64);
+    write(int8_t(0), L2_SIZE * 2 * L1_SIZE, 64); // Hidden layer
+    write(int32_t(0), L2_SIZE, 4096);
+    write(int8_t(0), L2_SIZE, 64); // Output
+    write(int32_t(0), 1, 4096);
+
+    return bool(file);
+}
+
+// Evaluates the leaves with the incrementally updated accumulators, and compares with a position set from scratch, whose
+// accumulators are always refreshed as it has no previous ply
+template<Side Me>
+void nnueWalk(Position &pos, Position &fresh, NNUE::AccumulatorStack &accumulators, NNUE::AccumulatorStack &freshAccumulators,
+              int depth, size_t &nbEvals, size_t &nbErrors) {
+    if (depth == 0) {
+        fresh.setFromFEN(pos.fen());
+        nbErrors += NNUE::evaluate<Me>(pos, accumulators) != NNUE::evaluate<Me>(fresh, freshAccumulators);
+        nbEvals++;
+        return;
+    }
+
+    enumerateLegalMoves<Me>(pos, [&](Move m) {
+        pos.doMove<Me>(m);
+        nnueWalk<~Me>(pos, fresh, accumulators, freshAccumulators, depth - 1, nbEvals, nbErrors);
+        pos.undoMove<Me>(m);
+        return true;
+    });
+
+    if (!pos.inCheck()) {
+        pos.doNullMove<Me>();
+        nnueWalk<~Me>(pos, fresh, accumulators, freshAccumulators, depth - 1, nbEvals, nbErrors);
+        pos.undoNullMove<Me>();
+    }
+}
+
+void runNNUE() {
+    const std::string path = "belette-test.nnue";
+    const std::string previousFile = NNUE::loadedFile(); // Loaded again after the test
+    size_t nbEvals = 0, nbErrors = 0;
+
+    console << "[Test NNUE] incremental accumulators, random network" << std::endl;
+
+    if (!writeRandomNetwork(path) || !NNUE::load(path)) {
+        console << "  FAILED! - could not write or load " << path << std::endl;
+        std::remove(path.c_str());
+        if (!previousFile.empty()) NNUE::load(previousFile);
+        printResult(1);
+        return;
+    }
+
+    Position pos, fresh;
+    auto accumulators = std::make_unique<NNUE::AccumulatorStack>();
+    auto freshAccumulators = std::make_unique<NNUE::AccumulatorStack>();
+
+    for (auto t : ALL_TESTS) {
+        pos.setFromFEN(t.fen);
+        pos.getSideToMove() == WHITE ? NNUE::evaluate<WHITE>(pos, *accumulators) : NNUE::evaluate<BLACK>(pos, *accumulators);
+        pos.getSideToMove() == WHITE ? nnueWalk<WHITE>(pos, fresh, *accumulators, *freshAccumulators, 3, nbEvals, nbErrors)
+                                     : nnueWalk<BLACK>(pos, fresh, *accumulators, *freshAccumulators, 3, nbEvals, nbErrors);
+    }
+
+    NNUE::unload();
+    std::remove(path.c_str());
+
+    if (!previousFile.empty() && !NNUE::load(previousFile)) {
+        console << "  FAILED! - could not load " << previousFile << " again" << std::endl;
+        nbErrors++;
+    }
+
+    if (nbErrors == 0) {
+        console << "  SUCCESS - " << nbEvals << " evaluations match a refresh" << std::endl;
+    } else {
+        console << "  FAILED! - " << nbErrors << " evaluations on " << nbEvals << " differ from a refresh" << std::endl;
+    }
+
+    console << std::endl << std::endl;
+
+    printResult(nbErrors);
 }
 
 } /* namespace Belette::Test */
@@ -4,6 +4,9 @@
 namespace Belette::Test {
 
 void run();
+void runTT();
+void runThreads();
+void runNNUE();
 
 } /* namespace Belette::Test */
 
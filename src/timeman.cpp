@@ -0,0 +1,51 @@
+#include <algorithm>
+#include "timeman.h"
+
+namespace Belette {
+
+void TimeManager::init(TimeMs timeLeft, TimeMs increment, int movesToGo, TimeMs moveOverhead) {
+    // Keep the overhead of every remaining move aside
+    int mtg = movesToGo > 0 ? std::min(movesToGo, 50) : 40;
+    TimeMs available = std::max<TimeMs>(1, timeLeft + increment * (mtg - 1) - moveOverhead * (mtg + 2));
+
+    optimumTime = available / mtg;
+    maximumTime = optimumTime * (mtg == 1 ? 1 : 5);
+
+    // Never risk more than a part of what is on the clock
+    TimeMs safeTime = std::max<TimeMs>(1, timeLeft - moveOverhead);
+    optimumTime = std::clamp<TimeMs>(optimumTime, 1, safeTime * 6 / 10);
+    maximumTime = std::clamp<TimeMs>(maximumTime, optimumTime, safeTime * 8 / 10);
+
+    scaledOptimumTime = optimumTime;
+    previousBestMove = MOVE_NONE;
+    previousScore = SCORE_NONE;
+    bestMoveStability = 0;
+}
+
+void TimeManager::update(int depth, Move bestMove, Score score, double bestMoveNodeShare) {
+    bestMoveStability = bestMove == previousBestMove ? std::min(bestMoveStability + 1, 6) : 0;
+
+    // Early iterations are too noisy
+    if (depth >= 5) {
+        // Best move changes a lot: think longer, stable: think less
+        double stabilityFactor = 1.4 - 0.1 * bestMoveStability;
+
+        // Score dropping since the last iteration: think longer
+        double scoreFactor = previousScore == SCORE_NONE ? 1.0 : std::clamp(1.0 + (previousScore - score) / 200.0, 0.9, 1.6);
+
+        // Most of the effort spent on the best move means the alternatives are easily refuted
+        double nodesFactor = 1.6 - bestMoveNodeShare;
+
+        scaledOptimumTime = std::min<TimeMs>(maximumTime, optimumTime * stabilityFactor * scoreFactor * nodesFactor);
+    }
+
+    previousBestMove = bestMove;
+    previousScore = score;
+}
+
+// Next iteration takes at least twice as long as the last one, don't start it if it can not finish before the maximum time
+bool TimeManager::canStartIteration(TimeMs elapsed, TimeMs clockElapsed, TimeMs lastIterationTime) const {
+    return elapsed < scaledOptimumTime && clockElapsed + 2 * lastIterationTime <= maximumTime;
+}
+
+} /* namespace Belette */
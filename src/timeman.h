@@ -0,0 +1,38 @@
+#ifndef TIMEMAN_H_INCLUDED
+#define TIMEMAN_H_INCLUDED
+
+#include "chess.h"
+#include "utils.h"
+
+namespace Belette {
+
+constexpr TimeMs DEFAULT_MOVE_OVERHEAD = 10;
+
+// Time allocation for tournament time controls. The optimum time is scaled after each iteration,
+// no iteration is started after it, and the search never goes past the maximum time
+class TimeManager {
+public:
+    void init(TimeMs timeLeft, TimeMs increment, int movesToGo, TimeMs moveOverhead);
+    void update(int depth, Move bestMove, Score score, double bestMoveNodeShare);
+
+    // elapsed counts from the start of the search like the optimum, clockElapsed from the start of our clock like the maximum.
+    // They differ when pondering
+    bool canStartIteration(TimeMs elapsed, TimeMs clockElapsed, TimeMs lastIterationTime) const;
+
+    inline TimeMs optimum() const { return optimumTime; }
+    inline TimeMs maximum() const { return maximumTime; }
+    inline TimeMs scaledOptimum() const { return scaledOptimumTime; }
+
+private:
+    TimeMs optimumTime;
+    TimeMs maximumTime;
+    TimeMs scaledOptimumTime;
+
+    Move previousBestMove;
+    Score previousScore;
+    int bestMoveStability; // Number of iterations in a row with the same best move
+};
+
+} /* namespace Belette */
+
+#endif /* TIMEMAN_H_INCLUDED */
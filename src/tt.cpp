@@ -1,53 +1,393 @@
 #include <cstring>
+#include <cassert>
 #include <stdexcept>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <cstdio>
+#include <chrono>
+#include <immintrin.h>
 #include "tt.h"
 
 namespace Belette {
 
-// Global Transposition Table
-TranspositionTable tt;
+static inline uint64_t generationSalt(uint64_t generation) {
+    uint64_t z = generation * 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// Hash file layout: a header padded to a page, so the buckets can be mapped directly, followed by the raw buckets
+constexpr char TT_FILE_MAGIC[8] = {'B', 'E', 'L', 'E', 'T', 'T', 'E', 'H'};
+constexpr uint32_t TT_FILE_VERSION = 1; // Increase when the layout of TTEntry or TTBucket changes
+constexpr size_t TT_FILE_HEADER_SIZE = 4096;
+constexpr size_t TT_FILE_CHUNK_SIZE = 1024*1024;
+
+struct TTFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t bucketSize;
+    uint64_t nbBuckets;
+    uint64_t generation;
+    uint64_t salt;
+    uint64_t checksum; // Of the buckets
+    uint8_t age;
+};
+
+static_assert(sizeof(TTFileHeader) <= TT_FILE_HEADER_SIZE);
 
-TranspositionTable::TranspositionTable(size_t defaultSize): buckets(nullptr), nbBuckets(0), age(0) {
+// Shared memory layout: this header padded to a page, followed by the buckets
+constexpr uint32_t TT_SHARED_VERSION = 2;
+constexpr size_t TT_SHARED_HEADER_SIZE = 4096;
+
+struct TTSharedHeader {
+    std::atomic<bool> ready; // Set by the process creating the segment once the header is initialized
+    uint32_t version;
+    uint32_t bucketSize;
+    uint64_t nbBuckets;
+    TTControl control;
+};
+
+static_assert(sizeof(TTSharedHeader) <= TT_SHARED_HEADER_SIZE);
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<bool>::is_always_lock_free); // Must work across processes
+
+static inline uint64_t checksum(uint64_t hash, const uint64_t *words, size_t nbWords) {
+    for (size_t i = 0; i < nbWords; i++) {
+        hash = (std::rotl(hash, 23) ^ words[i]) * 0x9E3779B97F4A7C15ull;
+    }
+
+    return hash;
+}
+
+TranspositionTable::TranspositionTable(size_t defaultSize)
+: buckets(nullptr), nbBuckets(0), control(&localControl), lastAge(0), shared(nullptr), clearing(false), backgroundAborted(false) {
     resize(defaultSize);
 }
 
-TranspositionTable::~TranspositionTable(){
-    if (buckets != nullptr)
-        std::free(buckets);
+TranspositionTable::~TranspositionTable() {
+    release();
 }
 
+// Memory is only allocated when the table is first cleared, so several "setoption name Hash" in a row are cheap
 void TranspositionTable::resize(size_t size){
-    if (buckets != nullptr) {
-        std::free(buckets);
-        buckets = nullptr;
+    release();
+    nbBuckets = size / sizeof(TTBucket);
+}
+
+// Use a named shared memory segment instead of private memory (empty name), effective on next allocation.
+// The first process creates the segment with its own size, the following ones use the size of the segment
+void TranspositionTable::setSharedName(const std::string &name) {
+    release();
+    sharedName = name;
+}
+
+void TranspositionTable::allocate() {
+    // Fallback to private memory if the segment can not be used
+    if (!sharedName.empty() && attachShared()) return;
+
+    if (!memory.allocate(nbBuckets * sizeof(TTBucket), sizeof(TTBucket)))
+        throw std::runtime_error("failed to allocate memory for transposition table");
+
+    buckets = static_cast<TTBucket *>(memory.data());
+}
+
+bool TranspositionTable::attachShared() {
+    bool created;
+
+    if (!memory.mapShared(sharedName, TT_SHARED_HEADER_SIZE + nbBuckets * sizeof(TTBucket), created))
+        return false;
+
+    TTSharedHeader *header = static_cast<TTSharedHeader *>(memory.data());
+
+    if (created) {
+        // The new segment is zero filled, so the control block is already initialized
+        header->version = TT_SHARED_VERSION;
+        header->bucketSize = sizeof(TTBucket);
+        header->nbBuckets = nbBuckets;
+        header->ready.store(true, std::memory_order_release);
+    } else {
+        for (int i = 0; i < 1000 && !header->ready.load(std::memory_order_acquire); i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        if (!header->ready.load(std::memory_order_acquire)
+         || header->version != TT_SHARED_VERSION
+         || header->bucketSize != sizeof(TTBucket)
+         || memory.size() != TT_SHARED_HEADER_SIZE + header->nbBuckets * sizeof(TTBucket))
+        {
+            memory.release();
+            return false;
+        }
+
+        nbBuckets = header->nbBuckets;
     }
 
-    nbBuckets = size / sizeof(TTBucket);
+    shared = header;
+    control = &header->control;
+    lastAge = -1;
+    buckets = reinterpret_cast<TTBucket *>(static_cast<char *>(memory.data()) + TT_SHARED_HEADER_SIZE);
+
+    return true;
+}
+
+// Free the memory, or detach from the shared segment. The last process to detach removes the segment
+void TranspositionTable::release() {
+    stopBackgroundTask();
 
-    if (nbBuckets > 0) {
-        buckets = static_cast<TTBucket *>(std::malloc(sizeof(TTBucket) * nbBuckets));
-        if (!buckets) throw std::runtime_error("failed to allocate memory for transposition table");
+    memory.release();
+    buckets = nullptr;
+    shared = nullptr;
+    control = &localControl;
+}
+
+#ifdef TT_STATS
+void TTStats::reset() {
+    probes = hits = tornReads = collisions = stores = updates = 0;
+    for (auto &r : replacements) r = 0;
+}
+#endif
+
+void TranspositionTable::newGeneration() {
+    control->salt.store(generationSalt(control->generation.fetch_add(1) + 1), std::memory_order_relaxed);
+}
+
+// Start a new generation: the table can be used right away, entries of the previous generation are ignored
+// because their keys were salted differently. The memory itself is zeroed by a background thread
+void TranspositionTable::clear(int nbThreads) {
+    if (!allocated()) allocate();
+
+    // Other processes are using the shared table, keep their entries
+    if (isShared() && memory.isSharedWithOthers()) return;
+
+    // A zeroing still running from a previous clear() is good enough, the new salt already invalidates everything
+    if (!clearing) stopBackgroundTask();
+
+    newGeneration();
+    control->age = 0;
+    lastAge = 0;
+
+#ifdef TT_STATS
+    stats.reset();
+#endif
+
+    if (backgroundThread.joinable()) return;
+
+    clearing = true;
+    backgroundAborted = false;
+    backgroundThread = std::thread([this, nbThreads] {
+        zero(nbThreads);
+        clearing = false;
+    });
+}
+
+// Wait for the background zeroing or file verification to finish
+void TranspositionTable::waitForBackgroundTask() {
+    if (backgroundThread.joinable()) backgroundThread.join();
+}
+
+void TranspositionTable::stopBackgroundTask() {
+    backgroundAborted = true;
+    waitForBackgroundTask();
+}
+
+// Zero the table using several threads. Each thread touches its own part of the table first,
+// which also spreads the pages on the NUMA nodes the threads are running on.
+// The table may be used by a search at the same time, so words are zeroed atomically
+void TranspositionTable::zero(int nbThreads) {
+    constexpr size_t ABORT_CHECK_INTERVAL = 4096;
+
+    std::vector<std::thread> threads;
+    size_t chunkSize = (nbBuckets + nbThreads - 1) / nbThreads;
+
+    for (int i = 0; i < nbThreads; i++) {
+        size_t begin = std::min(nbBuckets, i * chunkSize);
+        size_t end = std::min(nbBuckets, begin + chunkSize);
+
+        auto clearChunk = [this, begin, end] {
+            for (size_t b = begin; b < end; b++) {
+                if (b % ABORT_CHECK_INTERVAL == 0 && backgroundAborted.load(std::memory_order_relaxed)) return;
+
+                uint8_t age = control->age.load(std::memory_order_relaxed);
+
+                for (int j = 0; j < TT_ENTRIES_PER_BUCKET; j++) {
+                    TTSlot slot = buckets[b].slot(j);
+                    TTEntry tte(slot.data());
+
+                    // Keep what the searches started since clear() wrote, their ages are in ]0, age].
+                    // Entries of the previous generation with the same ages are kept too, but they never match anyway
+                    if (tte.age() != 0 && tte.age() <= age) continue;
+
+                    slot.store(0, 0);
+                }
+            }
+        };
+
+        if (i == nbThreads - 1) {
+            clearChunk();
+        } else {
+            threads.emplace_back(clearChunk);
+        }
     }
 
-    clear();
+    for (auto &th : threads) th.join();
 }
 
-void TranspositionTable::clear() {
-    std::memset(buckets, 0, nbBuckets * sizeof(TTBucket));
-    age = 0;
+// Write the table to a file. Must not be called while searching
+bool TranspositionTable::save(const std::string &path) {
+    if (!allocated()) return false;
+
+    waitForBackgroundTask();
+
+    TTFileHeader header = {};
+    std::copy(std::begin(TT_FILE_MAGIC), std::end(TT_FILE_MAGIC), header.magic);
+    header.version = TT_FILE_VERSION;
+    header.bucketSize = sizeof(TTBucket);
+    header.nbBuckets = nbBuckets;
+    header.generation = control->generation;
+    header.salt = control->salt;
+    header.age = control->age;
+
+    const char *bytes = reinterpret_cast<const char *>(buckets);
+    size_t size = nbBuckets * sizeof(TTBucket);
+
+    for (size_t offset = 0; offset < size; offset += TT_FILE_CHUNK_SIZE) {
+        size_t chunkSize = std::min(TT_FILE_CHUNK_SIZE, size - offset);
+        header.checksum = checksum(header.checksum, reinterpret_cast<const uint64_t *>(bytes + offset), chunkSize / sizeof(uint64_t));
+    }
+
+    // Write to a temporary file first, so an existing file is not lost if something goes wrong
+    std::string tmpPath = path + ".tmp";
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    std::vector<char> padding(TT_FILE_HEADER_SIZE - sizeof(header), 0);
+
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(padding.data(), padding.size());
+    file.write(bytes, size);
+    file.close();
+
+    if (!file || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        std::remove(tmpPath.c_str());
+        return false;
+    }
+
+    return true;
 }
 
+// Replace the table with the content of a file written by save(). The table takes the size of the file.
+// The buckets are mapped, so a big table is usable right away; the checksum is verified in the background
+// and the table is invalidated if it does not match. Must not be called while searching
+bool TranspositionTable::load(const std::string &path) {
+    TTFileHeader header;
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+
+    if (!file) return false;
+
+    size_t fileSize = file.tellg();
+    if (fileSize < TT_FILE_HEADER_SIZE) return false;
+
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof(header))) return false;
+
+    if (!std::equal(std::begin(TT_FILE_MAGIC), std::end(TT_FILE_MAGIC), header.magic)
+     || header.version != TT_FILE_VERSION
+     || header.bucketSize != sizeof(TTBucket)
+     || header.nbBuckets == 0
+     || fileSize != TT_FILE_HEADER_SIZE + header.nbBuckets * sizeof(TTBucket))
+        return false;
+
+    // A loaded table is always private. If mapping fails, the previous table is lost and allocated again on next clear()
+    release();
+
+    if (!memory.map(path, TT_FILE_HEADER_SIZE, header.nbBuckets * sizeof(TTBucket), sizeof(TTBucket)))
+        return false;
+
+    buckets = static_cast<TTBucket *>(memory.data());
+    nbBuckets = header.nbBuckets;
+    control->generation = header.generation;
+    control->salt = header.salt;
+    control->age = header.age;
+    lastAge = header.age;
+
+    backgroundAborted = false;
+    backgroundThread = std::thread([this, path, expected = header.checksum] { verifyFile(path, expected); });
+
+    return true;
+}
+
+// Read the file rather than the mapped table, which may already have been modified by a search
+void TranspositionTable::verifyFile(const std::string &path, uint64_t expectedChecksum) {
+    std::ifstream file(path, std::ios::binary);
+    std::vector<uint64_t> chunk(TT_FILE_CHUNK_SIZE / sizeof(uint64_t));
+    size_t remaining = nbBuckets * sizeof(TTBucket);
+    uint64_t hash = 0;
+
+    file.seekg(TT_FILE_HEADER_SIZE);
+
+    while (file && remaining > 0) {
+        if (backgroundAborted.load(std::memory_order_relaxed)) return;
+
+        size_t chunkSize = std::min(TT_FILE_CHUNK_SIZE, remaining);
+        file.read(reinterpret_cast<char *>(chunk.data()), chunkSize);
+        hash = checksum(hash, chunk.data(), chunkSize / sizeof(uint64_t));
+        remaining -= chunkSize;
+    }
+
+    // Corrupted: start a new generation so none of the entries can match anymore
+    if (!file || hash != expectedChecksum) {
+        newGeneration();
+    }
+}
+
+// With a shared table the age only moves once per round of searches: a process that did not search with the current age yet
+// adopts it instead of increasing it, so processes don't make each other's fresh entries look old
 void TranspositionTable::newSearch() {
-    age += TTEntry::AGE_DELTA;
+    uint8_t age = control->age.load();
+
+    if (age == lastAge)
+        control->age.compare_exchange_strong(age, uint8_t(age + TTEntry::AGE_DELTA));
+
+    lastAge = control->age.load();
+}
+
+// Depth and age of the entries, on a sample spread over the whole table
+TTOccupancy TranspositionTable::occupancy(size_t maxBuckets) const {
+    TTOccupancy occ;
+
+    if (!allocated() || nbBuckets == 0) return occ;
+
+    uint8_t age = control->age.load(std::memory_order_relaxed);
+    size_t step = std::max<size_t>(1, nbBuckets / maxBuckets);
+
+    for (size_t i = 0; i < nbBuckets; i += step) {
+        for (int j = 0; j < TT_ENTRIES_PER_BUCKET; j++) {
+            TTEntry tte(buckets[i].slot(j).data());
+            occ.nbSlots++;
+
+            if (tte.empty()) continue;
+
+            int searchesAgo = ((TTEntry::AGE_CYCLE + age - tte.ageFlags8) & TTEntry::AGE_MASK) / TTEntry::AGE_DELTA;
+
+            occ.nbEntries++;
+            occ.depth[std::min(tte.depth(), TTOccupancy::MAX_DEPTH - 1)]++;
+            occ.age[searchesAgo]++;
+        }
+    }
+
+    return occ;
 }
 
 size_t TranspositionTable::usage() const {
-    const size_t sampleSize = 1000;
+    const size_t sampleSize = std::min<size_t>(1000, nbBuckets);
+
+    if (sampleSize == 0) return 0;
+
     size_t count = 0;
-    
+    uint8_t age = control->age.load(std::memory_order_relaxed);
+
     for (size_t i = 0; i < sampleSize; i++) {
         for (size_t j = 0; j < TT_ENTRIES_PER_BUCKET; j++) {
-            const TTEntry &tte = buckets[i].entries[j];
+            TTEntry tte(buckets[i].slot(j).data());
             count += !tte.empty() && tte.age() == age;
         }
     }
@@ -55,45 +395,100 @@ size_t TranspositionTable::usage() const {
     return 1000 * count / (sampleSize * TT_ENTRIES_PER_BUCKET);
 }
 
-std::tuple<bool, TTEntry *> TranspositionTable::get(uint64_t hash) {
+TranspositionTable::TTResult TranspositionTable::get(uint64_t hash) {
     TTBucket *bucket = &buckets[index(hash)];
+    uint8_t age = control->age.load(std::memory_order_relaxed);
+    hash ^= control->salt.load(std::memory_order_relaxed);
+
+    TT_STATS_INC(probes);
 
-    for (TTEntry *entry = bucket->begin(); entry < bucket->end(); entry++) {
-        if (entry->hashEquals(hash) || entry->empty()) {
-            entry->refresh(age);
+    // Compare all the keys of the bucket at once
+    __m256i keys = _mm256_load_si256(reinterpret_cast<const __m256i *>(bucket->keys));
+    __m256i data = _mm256_load_si256(reinterpret_cast<const __m256i *>(bucket->data));
+    __m256i hits = _mm256_cmpeq_epi64(_mm256_xor_si256(keys, data), _mm256_set1_epi64x(hash));
+    __m256i empties = _mm256_cmpeq_epi64(data, _mm256_setzero_si256());
+    int hitMask = _mm256_movemask_pd(_mm256_castsi256_pd(hits));
+    int emptyMask = _mm256_movemask_pd(_mm256_castsi256_pd(empties));
 
-            return TTResult(!entry->empty(), entry);
+    for (; hitMask; hitMask &= hitMask - 1) {
+        TTSlot slot = bucket->slot(__builtin_ctz(hitMask));
+
+        // Vector loads are not guaranteed to be atomic, verify the slot again
+        uint64_t d = slot.data();
+        if ((slot.key() ^ d) != hash) {
+            TT_STATS_INC(tornReads);
+            continue;
         }
+
+        TT_STATS_INC(hits);
+
+        TTEntry entry(d);
+
+        if (entry.age() != age) {
+            entry.refresh(age);
+            slot.store(hash, entry.data());
+        }
+
+        return TTResult(true, entry, slot);
+    }
+
+    if (emptyMask) {
+        return TTResult(false, TTEntry(), bucket->slot(__builtin_ctz(emptyMask)));
     }
 
-    TTEntry *toReplace = bucket->begin();
+    int toReplace = 0;
+    TTEntry toReplaceEntry(bucket->slot(0).data());
+
+    for (int i = 1; i < TT_ENTRIES_PER_BUCKET; i++) {
+        TTEntry entry(bucket->slot(i).data());
 
-    for (TTEntry *entry = bucket->begin() + 1; entry < bucket->end(); entry++) {
-        if (toReplace->isBetterToKeep(*entry, age)) {
-            toReplace = entry;
+        if (toReplaceEntry.isBetterToKeep(entry, age)) {
+            toReplace = i;
+            toReplaceEntry = entry;
         }
     }
 
-    return TTResult(false, toReplace);
+    // Even the worst entry of the bucket is from the current search: a position of this search will be lost
+    if (toReplaceEntry.age() == age) TT_STATS_INC(collisions);
+
+    return TTResult(false, TTEntry(), bucket->slot(toReplace));
 }
 
 // Update TTEntry with fresh informations. Logic is greatly inspired from stockfish
-void TranspositionTable::set(TTEntry *tte, uint64_t hash, int depth, int ply, Bound bound, Move move, Score eval, Score score, bool pv) {
+void TranspositionTable::set(TTSlot slot, uint64_t hash, int depth, int ply, Bound bound, Move move, Score eval, Score score, bool pv) {
     assert(depth >= 0);
-    assert(tte != nullptr);
+    assert(slot.data64 != nullptr);
     assert(move != MOVE_NULL);
 
-    if (move != MOVE_NONE || !tte->hashEquals(hash)) {
-        tte->move16 = move;
+    uint8_t age = control->age.load(std::memory_order_relaxed);
+    hash ^= control->salt.load(std::memory_order_relaxed);
+
+    // Work on a snapshot of the slot, it may be modified concurrently by another thread
+    uint64_t data = slot.data();
+    bool sameHash = (slot.key() ^ data) == hash;
+    TTEntry tte = sameHash ? TTEntry(data) : TTEntry();
+
+#ifdef TT_STATS
+    TTEntry replaced(data);
+    TT_STATS_INC(stores);
+    if (sameHash) TT_STATS_INC(updates);
+    else if (replaced.empty()) TT_STATS_INC(replacements[REPLACE_EMPTY]);
+    else if (replaced.age() != age) TT_STATS_INC(replacements[REPLACE_OLDER]);
+    else TT_STATS_INC(replacements[REPLACE_SHALLOWER]);
+#endif
+
+    if (move != MOVE_NONE || !sameHash) {
+        tte.move16 = move;
     }
 
-    if (bound == BOUND_EXACT || !tte->hashEquals(hash) || (depth + 2*pv + 2 > tte->depth())) {
-        tte->hash16 = (uint16_t)hash;
-        tte->eval16 = (int16_t)eval;
-        tte->score(score, ply);
-        tte->depth8 = (uint8_t)depth;
-        tte->ageFlags8 = (uint8_t)(age | (pv << 2) | bound);
+    if (bound == BOUND_EXACT || !sameHash || (depth + 2*pv + 2 > tte.depth())) {
+        tte.eval16 = (int16_t)eval;
+        tte.score(score, ply);
+        tte.depth8 = (uint8_t)depth;
+        tte.ageFlags8 = (uint8_t)(age | (pv << 2) | bound);
     }
+
+    slot.store(hash, tte.data());
 }
 
 } /* namespace Belette */
\ No newline at end of file
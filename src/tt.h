@@ -4,13 +4,33 @@
 #include <cstdlib>
 #include <cstdint>
 #include <tuple>
+#include <atomic>
+#include <bit>
+#include <thread>
+#include <string>
+#include <array>
 #include "chess.h"
+#include "memory.h"
 
 namespace Belette {
 
 constexpr size_t TT_DEFAULT_SIZE = 1024*1024*16;
 
-constexpr int TT_ENTRIES_PER_BUCKET = 3;
+constexpr int TT_ENTRIES_PER_BUCKET = 4;
+constexpr size_t TT_BUCKET_SIZE = 64; // Cache line
+
+// Instrumentation counters ("tt stats"), they slow down the search so they are only compiled in debug builds or with -DTT_STATS
+#if defined(DEBUG) && !defined(TT_STATS)
+#define TT_STATS
+#endif
+
+#ifdef TT_STATS
+#define TT_STATS_INC(counter) stats.counter.fetch_add(1, std::memory_order_relaxed)
+#else
+#define TT_STATS_INC(counter)
+#endif
+
+constexpr char TT_SHARED_NAME[] = "/belette-hash"; // POSIX shared memory object used by "Shared Hash"
 
 enum Bound {
     BOUND_NONE = 0,
@@ -19,6 +39,7 @@ enum Bound {
     BOUND_EXACT = BOUND_LOWER | BOUND_UPPER
 };
 
+// Entry content, packed in 64 bits so it can be read & written atomically
 class TTEntry {
 public:
     static constexpr uint8_t AGE_MASK   = 0b11111000;
@@ -27,8 +48,11 @@ public:
     static constexpr int AGE_DELTA = 0x8;
     static constexpr int AGE_CYCLE = 0xFF + AGE_DELTA;
 
-    inline bool empty() const { return hash16 == 0; }
-    inline bool hashEquals(uint64_t hash) const { return hash16 == (uint16_t)hash; }
+    TTEntry() = default;
+    explicit TTEntry(uint64_t data) { *this = std::bit_cast<TTEntry>(data); }
+    inline uint64_t data() const { return std::bit_cast<uint64_t>(*this); }
+
+    inline bool empty() const { return data() == 0; }
     inline Move move() const { return (Move)move16; }
     inline Score eval() const { return eval16; }
     inline Score score(int ply) const {
@@ -49,7 +73,7 @@ public:
     inline bool isExactBound() const { return bound() & BOUND_EXACT; }
     inline bool isLowerBound() const { return bound() & BOUND_LOWER; }
     inline bool isUpperBound() const { return bound() & BOUND_UPPER; }
-    inline bool canCutoff(Score score, Score beta) { return score != SCORE_NONE && (bound() & (score >= beta ? BOUND_LOWER : BOUND_UPPER)); }
+    inline bool canCutoff(Score score, Score beta) const { return score != SCORE_NONE && (bound() & (score >= beta ? BOUND_LOWER : BOUND_UPPER)); }
 
     inline void refresh(uint8_t age) { ageFlags8 = age | (ageFlags8 & (PV_MASK | BOUND_MASK)); }
 
@@ -60,52 +84,155 @@ public:
 private:
     friend class TranspositionTable;
 
-    uint16_t hash16;
-    Move move16;
-    int16_t eval16;
-    int16_t score16;
-    uint8_t depth8;
-    uint8_t ageFlags8;
-}; // 10 Bytes
+    Move move16 = MOVE_NONE;
+    int16_t eval16 = 0;
+    int16_t score16 = 0;
+    uint8_t depth8 = 0;
+    uint8_t ageFlags8 = 0;
+}; // 8 Bytes
+
+static_assert(sizeof(TTEntry) == sizeof(uint64_t));
+
+// Lockless slot: the key is stored xored with the data, so a torn write (key and data from different stores)
+// doesn't match the hash anymore and is seen as a miss
+class TTSlot {
+public:
+    TTSlot() = default;
+    TTSlot(uint64_t *key_, uint64_t *data_): key64(key_), data64(data_) { }
+
+    inline uint64_t key() const { return std::atomic_ref<uint64_t>(*key64).load(std::memory_order_relaxed); }
+    inline uint64_t data() const { return std::atomic_ref<uint64_t>(*data64).load(std::memory_order_relaxed); }
+
+private:
+    friend class TranspositionTable;
+
+    inline void store(uint64_t hash, uint64_t data) {
+        std::atomic_ref<uint64_t>(*data64).store(data, std::memory_order_relaxed);
+        std::atomic_ref<uint64_t>(*key64).store(hash ^ data, std::memory_order_relaxed);
+    }
+
+    uint64_t *key64 = nullptr;
+    uint64_t *data64 = nullptr;
+};
+
+// State that must be the same for every user of the table, in shared memory when the table is shared between processes.
+// Keys are salted with a per generation value, so entries written before the last clear() never match
+struct TTControl {
+    std::atomic<uint64_t> generation = 0;
+    std::atomic<uint64_t> salt = 0;
+    std::atomic<uint8_t> age = 0;
+};
+
+struct TTSharedHeader;
+
+enum TTReplacement {
+    REPLACE_EMPTY,     // Empty slot
+    REPLACE_OLDER,     // Entry from a previous search
+    REPLACE_SHALLOWER, // Entry from the current search, with the lowest depth of the bucket
+    NB_REPLACEMENT
+};
+
+#ifdef TT_STATS
+// Counters since the last clear()
+struct TTStats {
+    std::atomic<uint64_t> probes;
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> tornReads;  // Key matched by the vector compare but not when reading the slot again
+    std::atomic<uint64_t> collisions; // Misses on a bucket only holding entries of the current search
+    std::atomic<uint64_t> stores;
+    std::atomic<uint64_t> updates;    // Stores on an entry of the same position
+    std::atomic<uint64_t> replacements[NB_REPLACEMENT];
+
+    void reset();
+};
+#endif
+
+struct TTOccupancy {
+    static constexpr int MAX_DEPTH = 64; // Last one counts deeper entries too
+    static constexpr int MAX_AGE = 32;   // Number of searches since the entry was written or refreshed
+
+    size_t nbSlots = 0;
+    size_t nbEntries = 0;
+    std::array<size_t, MAX_DEPTH> depth = {};
+    std::array<size_t, MAX_AGE> age = {};
+};
 
 class TranspositionTable {
 public:
-    using TTResult = std::tuple<bool, TTEntry *>;
+    // (hit, snapshot of the entry, slot to use when storing the result)
+    using TTResult = std::tuple<bool, TTEntry, TTSlot>;
 
     TranspositionTable(size_t defaultSize = TT_DEFAULT_SIZE);
     ~TranspositionTable();
 
     void resize(size_t size);
-    void clear();
+    void clear(int nbThreads = 1);
+    void waitForBackgroundTask();
+
+    bool save(const std::string &path);
+    bool load(const std::string &path);
+    void setSharedName(const std::string &name);
     void newSearch();
 
+    inline bool allocated() const { return !memory.empty(); }
+    inline bool isShared() const { return shared != nullptr; }
+
     TTResult get(uint64_t hash);
-    void set(TTEntry *tte, uint64_t hash, int depth, int ply, Bound bound, Move move, Score eval, Score score, bool pv);
+    void set(TTSlot slot, uint64_t hash, int depth, int ply, Bound bound, Move move, Score eval, Score score, bool pv);
 
     inline void prefetch(uint64_t hash) const { __builtin_prefetch(&buckets[index(hash)]); }
 
     size_t usage() const;
+    TTOccupancy occupancy(size_t maxBuckets = 1024*1024) const;
     inline size_t size() const { return nbBuckets; }
 
+#ifdef TT_STATS
+    inline const TTStats &getStats() const { return stats; }
+#endif
+
 private:
-    struct TTBucket {
-        TTEntry entries[TT_ENTRIES_PER_BUCKET];
-        uint16_t padding;
+    // One cache line, keys and data are stored in separate arrays so all the keys of a bucket can be compared at once
+    struct alignas(TT_BUCKET_SIZE) TTBucket {
+        uint64_t keys[TT_ENTRIES_PER_BUCKET];
+        uint64_t data[TT_ENTRIES_PER_BUCKET];
+
+        inline TTSlot slot(int i) { return TTSlot(&keys[i], &data[i]); }
+    }; // 64 Bytes
 
-        inline TTEntry *begin() { return &entries[0]; }
-        inline TTEntry *end() { return &entries[TT_ENTRIES_PER_BUCKET]; }
-    }; // 32 Bytes
+    static_assert(sizeof(TTBucket) == TT_BUCKET_SIZE);
 
+    LargeMemory memory;
     TTBucket *buckets;
     size_t nbBuckets;
-    uint8_t age;
+
+    TTControl localControl;
+    TTControl *control; // Points to localControl, or to the shared memory header
+    int lastAge; // Age of the last search of this process, -1 if it never searched with this table
+
+    std::string sharedName;
+    TTSharedHeader *shared;
+
+    // Thanks to the salt, zeroing the memory is only needed to reclaim the slots, it is done in the background
+    std::thread backgroundThread;
+    std::atomic<bool> clearing;
+    std::atomic<bool> backgroundAborted;
+
+#ifdef TT_STATS
+    TTStats stats;
+#endif
+
+    void allocate();
+    bool attachShared();
+    void release();
+    void newGeneration();
+    void zero(int nbThreads);
+    void stopBackgroundTask();
+    void verifyFile(const std::string &path, uint64_t expectedChecksum);
 
     //inline uint64_t index(uint64_t hash) { return hash % nbBuckets; }
     inline uint64_t index(uint64_t hash) const { return ((unsigned __int128)hash * (unsigned __int128)nbBuckets) >> 64; }
 };
 
-extern TranspositionTable tt;
-
 } /* namespace Belette */
 
 #endif /* TT_H_INCLUDED */
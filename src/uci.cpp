@@ -8,6 +8,7 @@
 #include "utils.h"
 #include "movepicker.h"
 #include "bench.h"
+#include "nnue.h"
 
 namespace Belette {
 
@@ -35,7 +36,42 @@ Uci::Uci()  {
     options["Hash"] = UciOption(16, 1, 1048576, [&] (const UciOption &opt) { 
         engine.setHashSize(int64_t(opt)*1024*1024);
     });
-    options["Threads"] = UciOption(1, 1, 1);
+    options["Threads"] = UciOption(1, 1, MAX_THREADS, [&] (const UciOption &opt) { 
+        engine.setNbThreads(int(int64_t(opt)));
+    });
+    options["MultiPV"] = UciOption(1, 1, MAX_MOVE, [&] (const UciOption &opt) {
+        engine.setMultiPV(int(int64_t(opt)));
+    });
+    options["Ponder"] = UciOption(false); // Only tells the GUI that pondering is supported
+    options["Move Overhead"] = UciOption(int(DEFAULT_MOVE_OVERHEAD), 0, 5000, [&] (const UciOption &opt) {
+        engine.setMoveOverhead(int64_t(opt));
+    });
+    options["Shared Hash"] = UciOption(false, [&] (const UciOption &opt) { engine.setSharedHash(opt); });
+    options["Clear Hash"] = UciOption([&] (const UciOption &) { engine.clearHash(); });
+#ifdef TT_STATS
+    options["TT Stats"] = UciOption(false, [&] (const UciOption &opt) { engine.showTTStats = opt; });
+#endif
+    options["Hash File"] = UciOption("belette.hash");
+    options["Save Hash"] = UciOption([&] (const UciOption &) {
+        std::string path = options["Hash File"];
+        console << "info string " << (engine.saveHash(path) ? "Hash saved to " : "Failed to save hash to ") << path << std::endl;
+    });
+    options["Load Hash"] = UciOption([&] (const UciOption &) {
+        std::string path = options["Hash File"];
+        console << "info string " << (engine.loadHash(path) ? "Hash loaded from " : "Failed to load hash from ") << path << std::endl;
+    });
+
+    options["EvalFile"] = UciOption(EVAL_FILE_EMBEDDED, [&] (const UciOption &opt) {
+        std::string path = opt;
+        console << "info string " << (loadEvalWeights(path) ? "Evaluation weights loaded from " : "Failed to load evaluation weights from ") << path << std::endl;
+    });
+    options["Use NNUE"] = UciOption(true, [&] (const UciOption &opt) { NNUE::setEnabled(opt); });
+    options["NNUE File"] = UciOption(NNUE::DEFAULT_FILE, [&] (const UciOption &opt) {
+        std::string path = opt;
+        bool loaded = !engine.isSearching() && NNUE::load(path);
+        console << "info string " << (loaded ? "Network loaded from " : "Failed to load network from ") << path << std::endl;
+    });
+    NNUE::load(NNUE::DEFAULT_FILE); // Silently stays with the PSQT evaluation when there is no network
 
     commands["uci"] = &Uci::cmdUci;
     commands["isready"] = &Uci::cmdIsReady;
@@ -44,6 +80,7 @@ Uci::Uci()  {
     commands["position"] = &Uci::cmdPosition;
     commands["go"] = &Uci::cmdGo;
     commands["stop"] = &Uci::cmdStop;
+    commands["ponderhit"] = &Uci::cmdPonderHit;
     commands["quit"] = &Uci::cmdQuit;
 
     commands["debug"] = &Uci::cmdDebug;
@@ -53,6 +90,7 @@ Uci::Uci()  {
     commands["perftmp"] = &Uci::cmdPerftmp;
     commands["test"] = &Uci::cmdTest;
     commands["bench"] = &Uci::cmdBench;
+    commands["tt"] = &Uci::cmdTT;
 }
 
 Square Uci::parseSquare(std::string str) {
@@ -119,10 +157,22 @@ Move Uci::parseMove(std::string str) const {
 
 void Uci::loop(int argc, char* argv[]) {
     if (argc > 1 && std::string(argv[1]) == "bench") {
-        int depth = DEFAULT_BENCH_DEPTH;
-        if (argc > 2) depth = parseInt(std::string(argv[2]));
+        if (argc > 2 && std::string(argv[2]) == "game") {
+            int depth = DEFAULT_BENCH_GAME_DEPTH;
+            if (argc > 3) depth = parseInt(std::string(argv[3]));
 
-        bench(depth);
+            benchGame(depth);
+        } else if (argc > 2 && std::string(argv[2]) == "eval") {
+            int depth = DEFAULT_BENCH_EVAL_DEPTH;
+            if (argc > 3) depth = parseInt(std::string(argv[3]));
+
+            benchEval(depth);
+        } else {
+            int depth = DEFAULT_BENCH_DEPTH;
+            if (argc > 2) depth = parseInt(std::string(argv[2]));
+
+            bench(depth);
+        }
 
         return;
     }
@@ -161,6 +211,9 @@ void Uci::loop(int argc, char* argv[]) {
     }
 
     // cleanup
+    engine.stop();
+    engine.waitForSearchFinish();
+
     console << "Exiting UCI loop" << std::endl;
 }
 
@@ -259,7 +312,7 @@ bool Uci::cmdGo(std::istringstream& is) {
                 params.searchMoves.push_back(m);
             }
         } else if (token == "ponder") {
-            // unsupported
+            params.ponder = true;
         } else if (token == "wtime") {
             is >> token;
             params.timeLeft[WHITE] = parseInt(token);
@@ -287,7 +340,7 @@ bool Uci::cmdGo(std::istringstream& is) {
             is >> token;
             params.maxTime = parseInt(token);
         } else if (token == "infinite") {
-             
+            params.infinite = true;
         }
     }
 
@@ -305,15 +358,17 @@ bool Uci::cmdDebug(std::istringstream& is) {
             return true;
         });
     } else if (token == "movepicker") {
+        ScoredMoveList moves;
+
         if (engine.position().getSideToMove() == WHITE) {
-            MovePicker<MAIN, WHITE> mp(engine.position());
+            MovePicker<MAIN, WHITE> mp(engine.position(), moves);
 
             mp.enumerate([&] (Move m, bool& skipQuiets) {
                 console << Uci::formatMove(m) << std::endl;
                 return true;
             });
         } else {
-            MovePicker<MAIN, BLACK> mp(engine.position());
+            MovePicker<MAIN, BLACK> mp(engine.position(), moves);
 
             mp.enumerate([&] (Move m, bool& skipQuiets) {
                 console << Uci::formatMove(m) << std::endl;
@@ -342,7 +397,18 @@ bool Uci::cmdDebug(std::istringstream& is) {
 }
 
 bool Uci::cmdEval(std::istringstream& is) {
-    console << "Static eval: " << evaluate(engine.position()) << std::endl;
+    std::string token;
+    is >> token;
+
+    if (token == "export") {
+        std::string path;
+        is >> path;
+        console << (saveEvalWeights(path) ? "Evaluation weights saved to " : "Failed to save evaluation weights to ") << path << std::endl;
+        return true;
+    }
+
+    auto cache = std::make_unique<EvalCache>();
+    console << "Static eval: " << evaluate(engine.position(), *cache) << std::endl;
     return true;
 }
 
@@ -369,30 +435,105 @@ bool Uci::cmdStop(std::istringstream& is) {
     return true;
 }
 
+bool Uci::cmdPonderHit(std::istringstream& is) {
+    engine.ponderHit();
+    return true;
+}
+
 bool Uci::cmdQuit(std::istringstream& is) {
     return false;
 }
 
 bool Uci::cmdTest(std::istringstream& is) {
-    Test::run();
+    std::string token;
+    is >> token;
+
+    if (token == "tt") {
+        Test::runTT();
+    } else if (token == "threads") {
+        Test::runThreads();
+    } else if (token == "nnue") {
+        Test::runNNUE();
+    } else {
+        Test::run();
+    }
     
     return true;
 }
 
 bool Uci::cmdBench(std::istringstream& is) {
-    int depth = DEFAULT_BENCH_DEPTH;
-    is >> depth;
+    std::string token;
+    is >> token;
 
-    bench(depth);
+    if (token == "game") {
+        int depth = DEFAULT_BENCH_GAME_DEPTH;
+        is >> depth;
+
+        benchGame(depth);
+    } else if (token == "eval") {
+        int depth = DEFAULT_BENCH_EVAL_DEPTH;
+        is >> depth;
+
+        benchEval(depth);
+    } else {
+        int depth = DEFAULT_BENCH_DEPTH;
+        if (!token.empty()) depth = parseInt(token);
+
+        bench(depth);
+    }
     
     return true;
 }
 
+bool Uci::cmdTT(std::istringstream& is) {
+    std::string token;
+    is >> token;
+
+    if (token != "stats") {
+        console << "Usage: tt stats" << std::endl;
+        return true;
+    }
+
+    auto tt = engine.transpositionTable();
+    TTOccupancy occ = tt->occupancy();
+
+    console << "Transposition table: " << tt->size() << " buckets (" << (tt->size() * TT_BUCKET_SIZE / (1024*1024)) << " MB)"
+            << (tt->isShared() ? ", shared" : "") << std::endl;
+
+#ifdef TT_STATS
+    const TTStats &stats = tt->getStats();
+    console << "  Probes:       " << stats.probes << std::endl;
+    console << "  Hits:         " << stats.hits << " (" << (100.0 * stats.hits / std::max<uint64_t>(1, stats.probes)) << "%)" << std::endl;
+    console << "  Collisions:   " << stats.collisions << std::endl;
+    console << "  Torn reads:   " << stats.tornReads << std::endl;
+    console << "  Stores:       " << stats.stores << " (" << stats.updates << " updates)" << std::endl;
+    console << "  Replacements: " << stats.replacements[REPLACE_EMPTY] << " empty, "
+                                  << stats.replacements[REPLACE_OLDER] << " older, "
+                                  << stats.replacements[REPLACE_SHALLOWER] << " shallower" << std::endl;
+#else
+    console << "  Counters are only available in debug builds (or built with -DTT_STATS)" << std::endl;
+#endif
+
+    console << "  Occupancy:    " << occ.nbEntries << " entries on " << occ.nbSlots << " sampled slots" << std::endl;
+
+    console << "  Depth:       ";
+    for (int d = 0; d < TTOccupancy::MAX_DEPTH; d++)
+        if (occ.depth[d]) console << " " << d << (d == TTOccupancy::MAX_DEPTH - 1 ? "+" : "") << ":" << occ.depth[d];
+    console << std::endl;
+
+    console << "  Searches ago:";
+    for (int a = 0; a < TTOccupancy::MAX_AGE; a++)
+        if (occ.age[a]) console << " " << a << ":" << occ.age[a];
+    console << std::endl;
+
+    return true;
+}
+
 void UciEngine::onSearchProgress(const SearchEvent &event) {
     console << "info"
         << " depth " << event.depth 
         << " seldepth " << event.selDepth 
-        << " multipv " << 1
+        << " multipv " << event.multiPv
         << " score " << Uci::formatScore(event.bestScore)
         << " nodes " << event.nbNodes
         << " nps " << (int)((float)event.nbNodes / std::max<std::common_type_t<int, TimeMs>>(1, event.elapsed) * 1000.0f)
@@ -410,7 +551,26 @@ void UciEngine::onSearchFinish(const SearchEvent &event) {
     Move bestMove = MOVE_NONE;
     if (!event.pv.empty()) bestMove = event.pv.front();
 
-    console << "bestmove " << Uci::formatMove(bestMove) << std::endl;
+#ifdef TT_STATS
+    if (showTTStats) {
+        const TTStats &stats = transpositionTable()->getStats();
+        console << "info string tt probes " << stats.probes << " hits " << stats.hits << " collisions " << stats.collisions
+                << " torn " << stats.tornReads << " stores " << stats.stores << " updates " << stats.updates
+                << " empty " << stats.replacements[REPLACE_EMPTY] << " older " << stats.replacements[REPLACE_OLDER]
+                << " shallower " << stats.replacements[REPLACE_SHALLOWER] << std::endl;
+    }
+#endif
+
+    // Time from the hard deadline to the best move
+    if (TimeMs deadline = stopDeadline())
+        console << "info string stop latency " << now() - deadline << " ms" << std::endl;
+
+    console << "bestmove " << Uci::formatMove(bestMove);
+
+    if (event.pv.size() >= 2)
+        console << " ponder " << Uci::formatMove(event.pv[1]);
+
+    console << std::endl;
 }
 
 
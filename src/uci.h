@@ -75,6 +75,9 @@ template <class T> Console& Console::log(const T& x, bool isInput) {
 
 
 class UciEngine : public Engine {
+public:
+    bool showTTStats = false;
+
 protected:
     virtual void onSearchProgress(const SearchEvent &event);
     virtual void onSearchFinish(const SearchEvent &event);
@@ -114,6 +117,7 @@ private:
     bool cmdPosition(std::istringstream& is);
     bool cmdGo(std::istringstream& is);
     bool cmdStop(std::istringstream& is);
+    bool cmdPonderHit(std::istringstream& is);
     bool cmdQuit(std::istringstream& is);
 
     bool cmdDebug(std::istringstream& is);
@@ -122,6 +126,7 @@ private:
     bool cmdPerftmp(std::istringstream& is);
     bool cmdTest(std::istringstream& is);
     bool cmdBench(std::istringstream& is);
+    bool cmdTT(std::istringstream& is);
 };
 
 } /* namespace Belette */